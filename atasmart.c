@@ -41,8 +41,13 @@
 #include <linux/hdreg.h>
 #include <linux/fs.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <linux/major.h>
+#include <poll.h>
 #include <regex.h>
 #include <sys/param.h>
+#include <pthread.h>
+#include <time.h>
 #include <libudev.h>
 
 #include "atasmart.h"
@@ -53,6 +58,13 @@
 
 #define SK_TIMEOUT 2000
 
+/* Linux SCSI midlayer status codes, not exported to userspace */
+#define SK_SG_DID_TIME_OUT 0x03
+#define SK_SG_DRIVER_TIMEOUT 0x06
+#define SK_SG_DRIVER_SENSE 0x08
+
+#define ELEMENTSOF(x) (sizeof(x)/sizeof((x)[0]))
+
 typedef enum SkDirection {
         SK_DIRECTION_NONE,
         SK_DIRECTION_IN,
@@ -97,6 +109,46 @@ typedef enum SkBlobTag {
         SK_BLOB_TAG_SMART_THRESHOLDS = MAKE_TAG('S', 'M', 'T', 'H')
 } SkBlobTag;
 
+/* IDENTIFY, SMART data and SMART thresholds with tag and length each,
+ * plus the SMART status */
+#define SK_BLOB_SIZE_MAX (3*(8+512) + 12)
+
+typedef enum SkSmartQuirk {
+        SK_SMART_QUIRK_9_POWERONMINUTES            = 0x000001,
+        SK_SMART_QUIRK_9_POWERONSECONDS            = 0x000002,
+        SK_SMART_QUIRK_9_POWERONHALFMINUTES        = 0x000004,
+        SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT = 0x000008,
+        SK_SMART_QUIRK_193_LOADUNLOAD              = 0x000010,
+        SK_SMART_QUIRK_194_10XCELSIUS              = 0x000020,
+        SK_SMART_QUIRK_194_UNKNOWN                 = 0x000040,
+        SK_SMART_QUIRK_200_WRITEERRORCOUNT         = 0x000080,
+        SK_SMART_QUIRK_201_DETECTEDTACOUNT         = 0x000100,
+        SK_SMART_QUIRK_5_UNKNOWN                   = 0x000200,
+        SK_SMART_QUIRK_9_UNKNOWN                   = 0x000400,
+        SK_SMART_QUIRK_197_UNKNOWN                 = 0x000800,
+        SK_SMART_QUIRK_198_UNKNOWN                 = 0x001000,
+        SK_SMART_QUIRK_190_UNKNOWN                 = 0x002000,
+        SK_SMART_QUIRK_232_AVAILABLERESERVEDSPACE  = 0x004000,
+        SK_SMART_QUIRK_233_MEDIAWEAROUTINDICATOR   = 0x008000,
+        SK_SMART_QUIRK_225_TOTALLBASWRITTEN        = 0x010000,
+        SK_SMART_QUIRK_4_UNUSED                    = 0x020000,
+        SK_SMART_QUIRK_226_TIMEWORKLOADMEDIAWEAR   = 0x040000,
+        SK_SMART_QUIRK_227_TIMEWORKLOADHOSTREADS   = 0x080000,
+        SK_SMART_QUIRK_228_WORKLOADTIMER           = 0x100000,
+        SK_SMART_QUIRK_3_UNUSED                    = 0x200000
+} SkSmartQuirk;
+
+/* Coalesces concurrent invocations of one command in thread safe
+ * mode: callers that arrive while it is in flight wait for the lock
+ * and then share its result instead of sending it again */
+typedef struct SkFlight {
+        unsigned in_flight;
+        unsigned seq;
+        int ret;
+        int error;
+        SkBool result;
+} SkFlight;
+
 struct SkDisk {
         char *name;
         int fd;
@@ -108,6 +160,10 @@ struct SkDisk {
         uint8_t smart_data[512];
         uint8_t smart_thresholds[512];
 
+        /* Attribute ID to 1-based slot in smart_data/smart_thresholds, 0 if not listed */
+        uint8_t smart_data_index[256];
+        uint8_t smart_thresholds_index[256];
+
         SkBool smart_initialized:1;
 
         SkBool identify_valid:1;
@@ -119,19 +175,99 @@ struct SkDisk {
 
         SkBool attribute_verification_bad:1;
 
+        /* Derived from the IDENTIFY data, valid until it is rewritten */
+        SkBool identify_parsed_data_valid:1;
+        SkBool quirks_valid:1;
         SkIdentifyParsedData identify_parsed_data;
+        SkSmartQuirk quirks;
+
+        /* Bumped whenever one of the pages above changes. Everything
+         * derived from them remembers the generation it was computed
+         * from and is recomputed lazily once that is outdated. */
+        unsigned generation;
+
+        unsigned smart_parsed_data_generation;
         SkSmartParsedData smart_parsed_data;
 
         /* cache for commonly used attributes */
-        SkBool attribute_cache_valid:1;
-        SkBool bad_attribute_now:1;
-        SkBool bad_attribute_in_the_past:1;
-        SkBool reallocated_sector_count_found:1;
-        SkBool current_pending_sector_found:1;
-        uint64_t reallocated_sector_count;
-        uint64_t current_pending_sector;
-
-        void *blob;
+        unsigned summary_generation;
+        SkSmartSummary summary;
+
+        /* Reused by every sk_disk_get_blob() call */
+        uint32_t blob[SK_BLOB_SIZE_MAX/4];
+
+        /* Only used after sk_disk_set_thread_safe(). lock serializes
+         * all calls on this disk, snapshot_lock only protects the
+         * snapshot pointer so that sk_disk_get_snapshot() never has
+         * to wait for a command to finish. Once the locks exist they
+         * are always taken, and thread_safe is only changed with both
+         * of them held. Not bitfields, since they are read without
+         * holding lock. */
+        SkBool thread_safe;
+        SkBool locks_initialized;
+        pthread_mutex_t lock;
+        unsigned lock_depth;
+        pthread_mutex_t snapshot_lock;
+        SkSnapshot *snapshot;
+        unsigned snapshot_generation;
+        SkBool snapshot_status_valid:1;
+        SkBool snapshot_status_good:1;
+
+        SkFlight read_data_flight;
+        SkFlight status_flight;
+
+        /* When the cached answers were last read from the device, in
+         * usec on the monotonic clock, 0 if never */
+        uint64_t smart_data_usec;
+        uint64_t status_usec;
+        SkBool status_valid:1;
+        SkBool status_good:1;
+        uint64_t status_ttl_usec;
+
+        /* See sk_disk_set_refresh_policy() */
+        uint64_t refresh_min_interval_usec;
+        unsigned refresh_max_per_hour;
+        uint64_t refresh_tat;
+
+        /* The sg node of the disk, used to queue SMART READ DATA with
+         * write() and collect it with read(), see disk_sg_open() */
+        int sg_fd;
+        SkBool sg_probed:1;
+
+        /* Submitted with disk_smart_read_data_submit(). Pending until
+         * the result has been collected, queued while the command is
+         * still with the sg driver. */
+        SkBool async_pending:1;
+        SkBool async_queued:1;
+        SkBool async_changed:1;
+        unsigned async_timeout;
+        int async_ret;
+        int async_error;
+        uint64_t async_usec;
+        struct sg_io_hdr async_hdr;
+        uint8_t async_cdb[16];
+        uint8_t async_sense[32];
+        uint8_t async_data[512];
+
+        /* Per command class in msec, 0 for SK_TIMEOUT. See
+         * sk_disk_set_timeout() and sk_disk_set_deadline(). */
+        unsigned timeout[_SK_COMMAND_CLASS_MAX];
+        uint64_t deadline_usec;
+
+        /* For the command currently being sent */
+        SkCommandClass command_class;
+        unsigned command_timeout;
+
+        /* See sk_disk_set_circuit_breaker(). While the breaker is
+         * open breaker_backoff is the current wait in msec, 0 while
+         * it is closed. */
+        unsigned breaker_threshold;
+        unsigned breaker_base;
+        unsigned breaker_max;
+        unsigned breaker_failures;
+        unsigned breaker_backoff;
+        uint64_t breaker_until;
+        SkBool breaker_probing:1;
 };
 
 /* ATA commands */
@@ -161,6 +297,152 @@ typedef enum SkSmartCommand {
 #define SK_MSECOND_VALID_LONG_MAX (30ULL * 365ULL * 24ULL * 60ULL * 60ULL * 1000ULL)
 
 static int init_smart(SkDisk *d);
+static void disk_smart_read_data_drain(SkDisk *d);
+static int disk_command_timeout_left(SkDisk *d);
+static void build_attribute_index(const uint8_t *page, uint8_t index[256]);
+static void disk_identify_invalidate(SkDisk *d);
+
+static void disk_publish_snapshot(SkDisk *d);
+
+static void disk_lock(SkDisk *d) {
+
+        if (!d->locks_initialized)
+                return;
+
+        pthread_mutex_lock(&d->lock);
+        d->lock_depth++;
+}
+
+static void disk_unlock(SkDisk *d) {
+        int saved_errno;
+
+        if (!d->locks_initialized)
+                return;
+
+        saved_errno = errno;
+
+        /* Hand out new data before the next command may start */
+        if (d->thread_safe &&
+            d->lock_depth == 1 &&
+            d->identify_valid &&
+            (d->snapshot_generation != d->generation ||
+             d->snapshot_status_valid != d->status_valid ||
+             d->snapshot_status_good != d->status_good))
+                disk_publish_snapshot(d);
+
+        d->lock_depth--;
+        pthread_mutex_unlock(&d->lock);
+
+        errno = saved_errno;
+}
+
+/* Only disks shared between threads coalesce commands. Blobs never
+ * send any, and the disks inside snapshots must not be written to at
+ * all, since any number of threads may read them. locks_initialized is
+ * checked rather than thread_safe because it never changes once the
+ * disk is shared. */
+static SkBool disk_coalesces(SkDisk *d) {
+        return d->locks_initialized && d->type != SK_DISK_TYPE_BLOB;
+}
+
+/* Called before taking the lock. Returns TRUE if the command is in
+ * flight already, and remembers how many had completed by now. */
+static SkBool flight_arrive(SkFlight *f, unsigned *seq) {
+        *seq = __sync_fetch_and_add(&f->seq, 0);
+        return __sync_fetch_and_add(&f->in_flight, 0) > 0;
+}
+
+/* Called with the lock held. Returns TRUE, and the result of the
+ * command, if the one in flight on arrival has completed since. */
+static SkBool flight_landed(SkFlight *f, SkBool joined, unsigned seq, int *ret, SkBool *result) {
+
+        if (!joined || f->seq == seq)
+                return FALSE;
+
+        *ret = f->ret;
+        *result = f->result;
+        errno = f->error;
+
+        return TRUE;
+}
+
+static void flight_start(SkFlight *f) {
+        __sync_add_and_fetch(&f->in_flight, 1);
+}
+
+static void flight_finish(SkFlight *f, int ret, SkBool result) {
+        f->ret = ret;
+        f->result = result;
+        f->error = errno;
+
+        __sync_add_and_fetch(&f->seq, 1);
+        __sync_sub_and_fetch(&f->in_flight, 1);
+}
+
+#define USEC_PER_SEC ((uint64_t) 1000000ULL)
+#define USEC_PER_HOUR (3600ULL * USEC_PER_SEC)
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        /* Cannot fail on Linux */
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * USEC_PER_SEC + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+/* Decides whether a SMART READ DATA or RETURN STATUS may be sent to
+ * the device right now. last is when the cached answer was read, 0 if
+ * there is none. The hourly budget is a token bucket, kept as the
+ * time at which it will be full again. Nothing is taken from it here,
+ * that is left to disk_refresh_charge(). */
+static SkBool disk_refresh_allowed(SkDisk *d, uint64_t last) {
+        uint64_t now, cost;
+
+        if (d->refresh_min_interval_usec <= 0 && d->refresh_max_per_hour <= 0)
+                return TRUE;
+
+        now = now_usec();
+
+        if (last > 0 && now - last < d->refresh_min_interval_usec)
+                return FALSE;
+
+        if (d->refresh_max_per_hour > 0) {
+                cost = USEC_PER_HOUR / d->refresh_max_per_hour;
+
+                if (d->refresh_tat > now && d->refresh_tat - now > USEC_PER_HOUR - cost)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Takes a token from the hourly budget, once the command has really
+ * been handed to the device */
+static void disk_refresh_charge(SkDisk *d) {
+        uint64_t now;
+
+        if (d->refresh_max_per_hour <= 0)
+                return;
+
+        now = now_usec();
+
+        if (d->refresh_tat < now)
+                d->refresh_tat = now;
+
+        d->refresh_tat += USEC_PER_HOUR / d->refresh_max_per_hour;
+}
+
+static void disk_new_generation(SkDisk *d) {
+
+        /* 0 is never a valid generation, so that zero-initialized
+         * caches count as outdated */
+        if (++d->generation == 0)
+                d->generation = 1;
+
+        /* Set again while the new attributes are verified */
+        d->attribute_verification_bad = FALSE;
+}
 
 static const char *disk_type_to_human_string(SkDiskType type) {
 
@@ -348,51 +630,76 @@ static int disk_linux_ide_command(SkDisk *d, SkAtaCommand command, SkDirection d
         }
 }
 
+static void sg_io_prepare(struct sg_io_hdr *io_hdr, unsigned timeout, int direction,
+                          const void *cdb, size_t cdb_len,
+                          void *data, size_t data_len,
+                          void *sense, size_t sense_len) {
+
+        memset(io_hdr, 0, sizeof(struct sg_io_hdr));
+
+        io_hdr->interface_id = 'S';
+        io_hdr->cmdp = (unsigned char*) cdb;
+        io_hdr->cmd_len = cdb_len;
+        io_hdr->dxferp = data;
+        io_hdr->dxfer_len = data_len;
+        io_hdr->sbp = sense;
+        io_hdr->mx_sb_len = sense_len;
+        io_hdr->dxfer_direction = direction;
+        io_hdr->timeout = timeout;
+}
+
+static int sg_io_check(const struct sg_io_hdr *io_hdr) {
+
+        if (io_hdr->host_status == SK_SG_DID_TIME_OUT ||
+            (io_hdr->driver_status & 0xF) == SK_SG_DRIVER_TIMEOUT) {
+                errno = ETIMEDOUT;
+                return -1;
+        }
+
+        return 0;
+}
+
 /* Sends a SCSI command block */
-static int sg_io(int fd, int direction,
+static int sg_io(int fd, unsigned timeout, int direction,
                  const void *cdb, size_t cdb_len,
                  void *data, size_t data_len,
                  void *sense, size_t sense_len) {
 
         struct sg_io_hdr io_hdr;
+        int ret;
 
-        memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
+        sg_io_prepare(&io_hdr, timeout, direction, cdb, cdb_len, data, data_len, sense, sense_len);
 
-        io_hdr.interface_id = 'S';
-        io_hdr.cmdp = (unsigned char*) cdb;
-        io_hdr.cmd_len = cdb_len;
-        io_hdr.dxferp = data;
-        io_hdr.dxfer_len = data_len;
-        io_hdr.sbp = sense;
-        io_hdr.mx_sb_len = sense_len;
-        io_hdr.dxfer_direction = direction;
-        io_hdr.timeout = SK_TIMEOUT;
+        if ((ret = ioctl(fd, SG_IO, &io_hdr)) < 0)
+                return ret;
 
-        return ioctl(fd, SG_IO, &io_hdr);
-}
+        if (sg_io_check(&io_hdr) < 0)
+                return -1;
 
-static int disk_passthrough_16_command(SkDisk *d, SkAtaCommand command, SkDirection direction, void* cmd_data, void* data, size_t *len) {
-        uint8_t *bytes = cmd_data;
-        uint8_t cdb[16];
-        uint8_t sense[32];
-        uint8_t *desc = sense+8;
-        int ret;
+        return ret;
+}
 
-        static const int direction_map[] = {
-                [SK_DIRECTION_NONE] = SG_DXFER_NONE,
-                [SK_DIRECTION_IN] = SG_DXFER_FROM_DEV,
-                [SK_DIRECTION_OUT] = SG_DXFER_TO_DEV
-        };
+static const int sat_direction_map[] = {
+        [SK_DIRECTION_NONE] = SG_DXFER_NONE,
+        [SK_DIRECTION_IN] = SG_DXFER_FROM_DEV,
+        [SK_DIRECTION_OUT] = SG_DXFER_TO_DEV
+};
 
-        assert(d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_16);
+/* Builds the 12 or 16 byte ATA Pass-Through command block, as
+ * described in "T10 04-262r8 ATA Command Pass-Through":
+ * http://www.t10.org/ftp/t10/document.04/04-262r8.pdf
+ *
+ * Returns the length of the command block. */
+static size_t sat_build_cdb(SkDiskType type, SkAtaCommand command, SkDirection direction, const uint8_t *bytes, uint8_t cdb[16]) {
 
-        /* ATA Pass-Through 16 byte command, as described in "T10 04-262r8
-         * ATA Command Pass-Through":
-         * http://www.t10.org/ftp/t10/document.04/04-262r8.pdf */
+        assert(type == SK_DISK_TYPE_ATA_PASSTHROUGH_12 || type == SK_DISK_TYPE_ATA_PASSTHROUGH_16);
 
-        memset(cdb, 0, sizeof(cdb));
+        memset(cdb, 0, 16);
 
-        cdb[0] = 0x85; /* OPERATION CODE: 16 byte pass through */
+        if (type == SK_DISK_TYPE_ATA_PASSTHROUGH_16)
+                cdb[0] = 0x85; /* OPERATION CODE: 16 byte pass through */
+        else
+                cdb[0] = 0xa1; /* OPERATION CODE: 12 byte pass through */
 
         if (direction == SK_DIRECTION_NONE) {
                 cdb[1] = 3 << 1;   /* PROTOCOL: Non-Data */
@@ -407,77 +714,21 @@ static int disk_passthrough_16_command(SkDisk *d, SkAtaCommand command, SkDirect
                 cdb[2] = 0x26;     /* OFF_LINE=0, CK_COND=1, T_DIR=0, BYT_BLOK=1, T_LENGTH=2 */
         }
 
-        cdb[3] = bytes[0]; /* FEATURES */
-        cdb[4] = bytes[1];
-
-        cdb[5] = bytes[2]; /* SECTORS */
-        cdb[6] = bytes[3];
-
-        cdb[8] = bytes[9]; /* LBA LOW */
-        cdb[10] = bytes[8]; /* LBA MID */
-        cdb[12] = bytes[7]; /* LBA HIGH */
-
-        cdb[13] = bytes[10] & 0x4F; /* SELECT */
-        cdb[14] = (uint8_t) command;
-
-        memset(sense, 0, sizeof(sense));
-
-        if ((ret = sg_io(d->fd, direction_map[direction], cdb, sizeof(cdb), data, len ? *len : 0, sense, sizeof(sense))) < 0)
-                return ret;
-
-        if (sense[0] != 0x72 || desc[0] != 0x9 || desc[1] != 0x0c) {
-                errno = EIO;
-                return -1;
-        }
-
-        memset(bytes, 0, 12);
-
-        bytes[1] = desc[3];
-        bytes[2] = desc[4];
-        bytes[3] = desc[5];
-        bytes[9] = desc[7];
-        bytes[8] = desc[9];
-        bytes[7] = desc[11];
-        bytes[10] = desc[12];
-        bytes[11] = desc[13];
-
-        return ret;
-}
-
-static int disk_passthrough_12_command(SkDisk *d, SkAtaCommand command, SkDirection direction, void* cmd_data, void* data, size_t *len) {
-        uint8_t *bytes = cmd_data;
-        uint8_t cdb[12];
-        uint8_t sense[32];
-        uint8_t *desc = sense+8;
-        int ret;
-
-        static const int direction_map[] = {
-                [SK_DIRECTION_NONE] = SG_DXFER_NONE,
-                [SK_DIRECTION_IN] = SG_DXFER_FROM_DEV,
-                [SK_DIRECTION_OUT] = SG_DXFER_TO_DEV
-        };
-
-        assert(d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_12);
-
-        /* ATA Pass-Through 12 byte command, as described in "T10 04-262r8
-         * ATA Command Pass-Through":
-         * http://www.t10.org/ftp/t10/document.04/04-262r8.pdf */
-
-        memset(cdb, 0, sizeof(cdb));
+        if (type == SK_DISK_TYPE_ATA_PASSTHROUGH_16) {
+                cdb[3] = bytes[0]; /* FEATURES */
+                cdb[4] = bytes[1];
 
-        cdb[0] = 0xa1; /* OPERATION CODE: 12 byte pass through */
+                cdb[5] = bytes[2]; /* SECTORS */
+                cdb[6] = bytes[3];
 
-        if (direction == SK_DIRECTION_NONE) {
-                cdb[1] = 3 << 1;   /* PROTOCOL: Non-Data */
-                cdb[2] = 0x20;     /* OFF_LINE=0, CK_COND=1, T_DIR=0, BYT_BLOK=0, T_LENGTH=0 */
+                cdb[8] = bytes[9]; /* LBA LOW */
+                cdb[10] = bytes[8]; /* LBA MID */
+                cdb[12] = bytes[7]; /* LBA HIGH */
 
-        } else if (direction == SK_DIRECTION_IN) {
-                cdb[1] = 4 << 1;   /* PROTOCOL: PIO Data-in */
-                cdb[2] = 0x2e;     /* OFF_LINE=0, CK_COND=1, T_DIR=1, BYT_BLOK=1, T_LENGTH=2 */
+                cdb[13] = bytes[10] & 0x4F; /* SELECT */
+                cdb[14] = (uint8_t) command;
 
-        } else if (direction == SK_DIRECTION_OUT) {
-                cdb[1] = 5 << 1;   /* PROTOCOL: PIO Data-Out */
-                cdb[2] = 0x26;     /* OFF_LINE=0, CK_COND=1, T_DIR=0, BYT_BLOK=1, T_LENGTH=2 */
+                return 16;
         }
 
         cdb[3] = bytes[1]; /* FEATURES */
@@ -490,10 +741,33 @@ static int disk_passthrough_12_command(SkDisk *d, SkAtaCommand command, SkDirect
         cdb[8] = bytes[10] & 0x4F; /* SELECT */
         cdb[9] = (uint8_t) command;
 
-        memset(sense, 0, sizeof(sense));
+        return 12;
+}
 
-        if ((ret = sg_io(d->fd, direction_map[direction], cdb, sizeof(cdb), data, len ? *len : 0, sense, sizeof(sense))) < 0)
-                return ret;
+/* Checks the status the sg driver reports for a queued command. With
+ * CK_COND set a SAT device answers with CHECK CONDITION and the ATA
+ * registers in the sense data, anything else means the command didn't
+ * make it. */
+static int sat_check_reply(const struct sg_io_hdr *io_hdr) {
+
+        if (sg_io_check(io_hdr) < 0)
+                return -1;
+
+        if (io_hdr->host_status != 0 ||
+            ((io_hdr->driver_status & 0xF) != 0 && (io_hdr->driver_status & 0xF) != SK_SG_DRIVER_SENSE) ||
+            (io_hdr->masked_status != GOOD && io_hdr->masked_status != CHECK_CONDITION) ||
+            io_hdr->sb_len_wr <= 0) {
+                errno = EIO;
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Copies the ATA registers out of the ATA Status Return descriptor
+ * the device sent back because we set CK_COND */
+static int sat_parse_sense(const uint8_t *sense, uint8_t *bytes) {
+        const uint8_t *desc = sense+8;
 
         if (sense[0] != 0x72 || desc[0] != 0x9 || desc[1] != 0x0c) {
                 errno = EIO;
@@ -511,6 +785,28 @@ static int disk_passthrough_12_command(SkDisk *d, SkAtaCommand command, SkDirect
         bytes[10] = desc[12]; /* SELECT */
         bytes[11] = desc[13]; /* ERROR */
 
+        return 0;
+}
+
+static int disk_passthrough_command(SkDisk *d, SkAtaCommand command, SkDirection direction, void* cmd_data, void* data, size_t *len) {
+        uint8_t *bytes = cmd_data;
+        uint8_t cdb[16];
+        uint8_t sense[32];
+        size_t cdb_len;
+        int ret;
+
+        assert(d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_12 || d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_16);
+
+        cdb_len = sat_build_cdb(d->type, command, direction, bytes, cdb);
+
+        memset(sense, 0, sizeof(sense));
+
+        if ((ret = sg_io(d->fd, d->command_timeout, sat_direction_map[direction], cdb, cdb_len, data, len ? *len : 0, sense, sizeof(sense))) < 0)
+                return ret;
+
+        if (sat_parse_sense(sense, bytes) < 0)
+                return -1;
+
         return ret;
 }
 
@@ -554,7 +850,7 @@ static int disk_sunplus_command(SkDisk *d, SkAtaCommand command, SkDirection dir
         memset(sense, 0, sizeof(sense));
 
         /* Issue request */
-        if ((ret = sg_io(d->fd, direction_map[direction], cdb, sizeof(cdb), data, len ? *len : 0, sense, sizeof(sense))) < 0)
+        if ((ret = sg_io(d->fd, d->command_timeout, direction_map[direction], cdb, sizeof(cdb), data, len ? *len : 0, sense, sizeof(sense))) < 0)
                 return ret;
 
         memset(cdb, 0, sizeof(cdb));
@@ -565,8 +861,11 @@ static int disk_sunplus_command(SkDisk *d, SkAtaCommand command, SkDirection dir
 
         memset(buf, 0, sizeof(buf));
 
+        if (disk_command_timeout_left(d) < 0)
+                return -1;
+
         /* Ask for response */
-        if ((ret = sg_io(d->fd, SG_DXFER_FROM_DEV, cdb, sizeof(cdb), buf, sizeof(buf), sense, sizeof(sense))) < 0)
+        if ((ret = sg_io(d->fd, d->command_timeout, SG_DXFER_FROM_DEV, cdb, sizeof(cdb), buf, sizeof(buf), sense, sizeof(sense))) < 0)
                 return ret;
 
         memset(bytes, 0, 12);
@@ -620,7 +919,7 @@ static int disk_jmicron_command(SkDisk *d, SkAtaCommand command, SkDirection dir
 
         memset(sense, 0, sizeof(sense));
 
-        if ((ret = sg_io(d->fd, SG_DXFER_FROM_DEV, cdb, sizeof(cdb), &port, sizeof(port), sense, sizeof(sense))) < 0)
+        if ((ret = sg_io(d->fd, d->command_timeout, SG_DXFER_FROM_DEV, cdb, sizeof(cdb), &port, sizeof(port), sense, sizeof(sense))) < 0)
                 return ret;
 
         /* Port & 0x04 is port #0, Port & 0x40 is port #1 */
@@ -660,7 +959,10 @@ static int disk_jmicron_command(SkDisk *d, SkAtaCommand command, SkDirection dir
 
         memset(sense, 0, sizeof(sense));
 
-        if ((ret = sg_io(d->fd, direction_map[direction], cdb, sizeof(cdb), data, len, sense, sizeof(sense))) < 0)
+        if (disk_command_timeout_left(d) < 0)
+                return -1;
+
+        if ((ret = sg_io(d->fd, d->command_timeout, direction_map[direction], cdb, sizeof(cdb), data, len, sense, sizeof(sense))) < 0)
                 return ret;
 
         memset(bytes, 0, 12);
@@ -690,7 +992,10 @@ static int disk_jmicron_command(SkDisk *d, SkAtaCommand command, SkDirection dir
                 cdb[10] = 0x00;
                 cdb[11] = 0xfd;
 
-                if ((ret = sg_io(d->fd, SG_DXFER_FROM_DEV, cdb, sizeof(cdb), regbuf, sizeof(regbuf), sense, sizeof(sense))) < 0)
+                if (disk_command_timeout_left(d) < 0)
+                        return -1;
+
+                if ((ret = sg_io(d->fd, d->command_timeout, SG_DXFER_FROM_DEV, cdb, sizeof(cdb), regbuf, sizeof(regbuf), sense, sizeof(sense))) < 0)
                         return ret;
 
                 bytes[2] = regbuf[14]; /* STATUS */
@@ -705,18 +1010,145 @@ static int disk_jmicron_command(SkDisk *d, SkAtaCommand command, SkDirection dir
         return ret;
 }
 
+static SkCommandClass command_class(SkAtaCommand command, const void *cmd_data) {
+
+        switch (command) {
+
+                case SK_ATA_COMMAND_IDENTIFY_DEVICE:
+                case SK_ATA_COMMAND_IDENTIFY_PACKET_DEVICE:
+                        return SK_COMMAND_CLASS_IDENTIFY;
+
+                case SK_ATA_COMMAND_CHECK_POWER_MODE:
+                        return SK_COMMAND_CLASS_STATUS;
+
+                case SK_ATA_COMMAND_SMART:
+                        break;
+        }
+
+        switch (ntohs(((const uint16_t*) cmd_data)[0])) {
+
+                case SK_SMART_COMMAND_READ_DATA:
+                case SK_SMART_COMMAND_READ_THRESHOLDS:
+                        return SK_COMMAND_CLASS_READ_DATA;
+
+                case SK_SMART_COMMAND_EXECUTE_OFFLINE_IMMEDIATE:
+                        return SK_COMMAND_CLASS_SELF_TEST;
+
+                case SK_SMART_COMMAND_RETURN_STATUS:
+                        return SK_COMMAND_CLASS_STATUS;
+
+                default:
+                        return SK_COMMAND_CLASS_CONTROL;
+        }
+}
+
+/* The commands that disk_refresh_allowed() decides about */
+static SkBool command_is_refresh(SkAtaCommand command, const void *cmd_data) {
+        uint16_t c;
+
+        if (command != SK_ATA_COMMAND_SMART)
+                return FALSE;
+
+        c = ntohs(((const uint16_t*) cmd_data)[0]);
+
+        return c == SK_SMART_COMMAND_READ_DATA || c == SK_SMART_COMMAND_RETURN_STATUS;
+}
+
+static SkBool disk_deadline_passed(SkDisk *d) {
+        return d->deadline_usec > 0 && now_usec() >= d->deadline_usec;
+}
+
+/* The timeout for the next command of class c, cut short by the
+ * deadline if there is one */
+static int disk_command_timeout(SkDisk *d, SkCommandClass c, unsigned *timeout) {
+        unsigned t;
+        uint64_t n, left;
+
+        if ((t = d->timeout[c]) <= 0)
+                t = SK_TIMEOUT;
+
+        if (d->deadline_usec > 0) {
+                n = now_usec();
+
+                if (n >= d->deadline_usec) {
+                        errno = ETIMEDOUT;
+                        return -1;
+                }
+
+                left = (d->deadline_usec - n + 999) / 1000;
+
+                if (left < t)
+                        t = (unsigned) left;
+        }
+
+        *timeout = t;
+        return 0;
+}
+
+/* For bridges that need several round trips for one command: what is
+ * left of the deadline for the next one */
+static int disk_command_timeout_left(SkDisk *d) {
+        return disk_command_timeout(d, d->command_class, &d->command_timeout);
+}
+
+/* Fails with ECANCELED while the breaker is open. Once the wait is
+ * over the next command goes through as a probe, and everything else
+ * keeps failing until its result has been recorded. */
+static int disk_breaker_check(SkDisk *d) {
+
+        if (d->breaker_backoff <= 0)
+                return 0;
+
+        if (d->breaker_probing || now_usec() < d->breaker_until) {
+                errno = ECANCELED;
+                return -1;
+        }
+
+        d->breaker_probing = TRUE;
+        return 0;
+}
+
+static void disk_breaker_record(SkDisk *d, int ret, int error) {
+
+        d->breaker_probing = FALSE;
+
+        if (d->breaker_threshold <= 0)
+                return;
+
+        if (ret >= 0) {
+                d->breaker_failures = 0;
+                d->breaker_backoff = 0;
+                return;
+        }
+
+        /* Only these suggest the device or the bridge is in trouble */
+        if (error != ETIMEDOUT && error != EIO)
+                return;
+
+        if (d->breaker_backoff > 0)
+                /* The probe failed */
+                d->breaker_backoff = d->breaker_backoff >= d->breaker_max / 2 ? d->breaker_max : d->breaker_backoff * 2;
+        else if (++d->breaker_failures >= d->breaker_threshold)
+                d->breaker_backoff = d->breaker_base;
+        else
+                return;
+
+        d->breaker_until = now_usec() + (uint64_t) d->breaker_backoff * 1000ULL;
+}
+
 static int disk_command(SkDisk *d, SkAtaCommand command, SkDirection direction, void* cmd_data, void* data, size_t *len) {
 
         static int (* const disk_command_table[_SK_DISK_TYPE_MAX]) (SkDisk *d, SkAtaCommand command, SkDirection direction, void* cmd_data, void* data, size_t *len) = {
                 [SK_DISK_TYPE_LINUX_IDE] = disk_linux_ide_command,
-                [SK_DISK_TYPE_ATA_PASSTHROUGH_12] = disk_passthrough_12_command,
-                [SK_DISK_TYPE_ATA_PASSTHROUGH_16] = disk_passthrough_16_command,
+                [SK_DISK_TYPE_ATA_PASSTHROUGH_12] = disk_passthrough_command,
+                [SK_DISK_TYPE_ATA_PASSTHROUGH_16] = disk_passthrough_command,
                 [SK_DISK_TYPE_SUNPLUS] = disk_sunplus_command,
                 [SK_DISK_TYPE_JMICRON] = disk_jmicron_command,
                 [SK_DISK_TYPE_BLOB] = NULL,
                 [SK_DISK_TYPE_AUTO] = NULL,
                 [SK_DISK_TYPE_NONE] = NULL
         };
+        int ret;
 
         assert(d);
         assert(d->type <= _SK_DISK_TYPE_MAX);
@@ -730,11 +1162,32 @@ static int disk_command(SkDisk *d, SkAtaCommand command, SkDirection direction,
                 return -1;
         }
 
-        return disk_command_table[d->type](d, command, direction, cmd_data, data, len);
-}
+        /* Never have two commands with the device at once. This may
+         * take a while and change the breaker, so do it before
+         * looking at either. */
+        if (d->async_queued)
+                disk_smart_read_data_drain(d);
 
-static int disk_identify_device(SkDisk *d) {
+        d->command_class = command_class(command, cmd_data);
+
+        if (disk_command_timeout(d, d->command_class, &d->command_timeout) < 0)
+                return -1;
+
+        if (disk_breaker_check(d) < 0)
+                return -1;
+
+        if (command_is_refresh(command, cmd_data))
+                disk_refresh_charge(d);
+
+        ret = disk_command_table[d->type](d, command, direction, cmd_data, data, len);
+        disk_breaker_record(d, ret, errno);
+
+        return ret;
+}
+
+static int disk_identify_device(SkDisk *d) {
         uint16_t cmd[6];
+        uint8_t identify[512];
         int ret;
         size_t len = 512;
         const uint8_t *p;
@@ -742,12 +1195,12 @@ static int disk_identify_device(SkDisk *d) {
         if (d->type == SK_DISK_TYPE_BLOB)
                 return 0;
 
-        memset(d->identify, 0, len);
+        memset(identify, 0, len);
         memset(cmd, 0, sizeof(cmd));
 
         cmd[1] = htons(1);
 
-        if ((ret = disk_command(d, SK_ATA_COMMAND_IDENTIFY_DEVICE, SK_DIRECTION_IN, cmd, d->identify, &len)) < 0)
+        if ((ret = disk_command(d, SK_ATA_COMMAND_IDENTIFY_DEVICE, SK_DIRECTION_IN, cmd, identify, &len)) < 0)
                 return ret;
 
         if (len != 512) {
@@ -756,7 +1209,7 @@ static int disk_identify_device(SkDisk *d) {
         }
 
         /* Check if IDENTIFY data is all NULs */
-        for (p = d->identify; p < (const uint8_t*) d->identify+len; p++)
+        for (p = identify; p < identify+len; p++)
                 if (*p) {
                         p = NULL;
                         break;
@@ -767,12 +1220,21 @@ static int disk_identify_device(SkDisk *d) {
                 return -1;
         }
 
+        /* Keep everything derived from it if nothing changed */
+        if (d->identify_valid &&
+            memcmp(identify, d->identify, sizeof(identify)) == 0)
+                return 0;
+
+        disk_identify_invalidate(d);
+
+        memcpy(d->identify, identify, sizeof(d->identify));
         d->identify_valid = TRUE;
+        disk_new_generation(d);
 
         return 0;
 }
 
-int sk_disk_check_sleep_mode(SkDisk *d, SkBool *awake) {
+static int disk_check_sleep_mode_unlocked(SkDisk *d, SkBool *awake) {
         int ret;
         uint16_t cmd[6];
         uint8_t status;
@@ -803,6 +1265,16 @@ int sk_disk_check_sleep_mode(SkDisk *d, SkBool *awake) {
         return 0;
 }
 
+int sk_disk_check_sleep_mode(SkDisk *d, SkBool *awake) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_check_sleep_mode_unlocked(d, awake);
+        disk_unlock(d);
+
+        return ret;
+}
+
 static int disk_smart_enable(SkDisk *d, SkBool b) {
         uint16_t cmd[6];
 
@@ -826,70 +1298,34 @@ static int disk_smart_enable(SkDisk *d, SkBool b) {
         return disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_NONE, cmd, NULL, 0);
 }
 
-int sk_disk_smart_read_data(SkDisk *d) {
-        uint16_t cmd[6];
-        int ret;
-        size_t len = 512;
+static SkBool smart_page_checksum_valid(const uint8_t *page) {
+        uint8_t sum = 0;
+        unsigned i;
 
-        if (init_smart(d) < 0)
-                return -1;
+        /* ATA8 7.52.6.12: all 512 bytes add up to zero */
+        for (i = 0; i < 512; i++)
+                sum += page[i];
 
-        if (!disk_smart_is_available(d)) {
-                errno = ENOTSUP;
-                return -1;
-        }
+        return sum == 0;
+}
 
-        if (d->type == SK_DISK_TYPE_BLOB)
-                return 0;
+static void smart_read_data_cmd(uint16_t cmd[6]) {
 
-        memset(cmd, 0, sizeof(cmd));
+        memset(cmd, 0, sizeof(uint16_t)*6);
 
         cmd[0] = htons(SK_SMART_COMMAND_READ_DATA);
         cmd[1] = htons(1);
         cmd[2] = htons(0x0000U);
         cmd[3] = htons(0x00C2U);
         cmd[4] = htons(0x4F00U);
-
-        if ((ret = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_IN, cmd, d->smart_data, &len)) < 0)
-                return ret;
-
-        d->smart_data_valid = TRUE;
-
-        return ret;
 }
 
-static int disk_smart_read_thresholds(SkDisk *d) {
-        uint16_t cmd[6];
-        int ret;
-        size_t len = 512;
-
-        if (!disk_smart_is_available(d)) {
-                errno = ENOTSUP;
-                return -1;
-        }
-
-        if (d->type == SK_DISK_TYPE_BLOB)
-                return 0;
-
-        memset(cmd, 0, sizeof(cmd));
-
-        cmd[0] = htons(SK_SMART_COMMAND_READ_THRESHOLDS);
-        cmd[1] = htons(1);
-        cmd[2] = htons(0x0000U);
-        cmd[3] = htons(0x00C2U);
-        cmd[4] = htons(0x4F00U);
-
-        if ((ret = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_IN, cmd, d->smart_thresholds, &len)) < 0)
-                return ret;
-
-        d->smart_thresholds_valid = TRUE;
-
-        return ret;
-}
+/* Checks whether SMART READ DATA should be sent at all. Returns 1 if
+ * not, because this is a blob or the refresh policy says no. */
+static int disk_smart_read_data_prepare(SkDisk *d, SkBool *changed) {
 
-int sk_disk_smart_status(SkDisk *d, SkBool *good) {
-        uint16_t cmd[6];
-        int ret;
+        assert(d);
+        assert(changed);
 
         if (init_smart(d) < 0)
                 return -1;
@@ -900,2169 +1336,4258 @@ int sk_disk_smart_status(SkDisk *d, SkBool *good) {
         }
 
         if (d->type == SK_DISK_TYPE_BLOB) {
+                *changed = FALSE;
+                return 1;
+        }
 
-                if (d->blob_smart_status_valid) {
-                        *good = d->blob_smart_status;
-                        return 0;
+        if (!disk_refresh_allowed(d, d->smart_data_valid ? d->smart_data_usec : 0)) {
+
+                if (!d->smart_data_valid) {
+                        errno = EAGAIN;
+                        return -1;
                 }
 
-                errno = ENXIO;
-                return -1;
+                *changed = FALSE;
+                return 1;
         }
 
-        memset(cmd, 0, sizeof(cmd));
+        return 0;
+}
 
-        cmd[0] = htons(SK_SMART_COMMAND_RETURN_STATUS);
-        cmd[1] = htons(0x0000U);
-        cmd[3] = htons(0x00C2U);
-        cmd[4] = htons(0x4F00U);
+/* Updates our copy from a page just read from the device */
+static int disk_smart_read_data_merge(SkDisk *d, const uint8_t *data, SkBool *changed) {
 
-        if ((ret = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_NONE, cmd, NULL, 0)) < 0)
-                return ret;
+        assert(d);
+        assert(data);
+        assert(changed);
 
-        /* SAT/USB bridges truncate packets, so we only check for 4F,
-         * not for 2C on those */
-        if ((d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_12 || cmd[3] == htons(0x00C2U)) &&
-            cmd[4] == htons(0x4F00U))
-                *good = TRUE;
-        else if ((d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_12 || cmd[3] == htons(0x002CU)) &&
-                 cmd[4] == htons(0xF400U))
-                *good = FALSE;
-        else {
+        if (!smart_page_checksum_valid(data)) {
                 errno = EIO;
                 return -1;
         }
 
-        return ret;
+        d->smart_data_usec = now_usec();
+
+        /* Most polls return the very same page, in which case we keep
+         * everything we derived from it. The checksum byte is the
+         * cheapest way to notice a change. */
+        if (d->smart_data_valid &&
+            data[511] == d->smart_data[511] &&
+            memcmp(data, d->smart_data, sizeof(d->smart_data)) == 0) {
+                *changed = FALSE;
+                return 0;
+        }
+
+        memcpy(d->smart_data, data, sizeof(d->smart_data));
+        build_attribute_index(d->smart_data, d->smart_data_index);
+        d->smart_data_valid = TRUE;
+        disk_new_generation(d);
+
+        *changed = TRUE;
+        return 0;
 }
 
-int sk_disk_smart_self_test(SkDisk *d, SkSmartSelfTest test) {
+/* Reads the SMART data into data, which must have room for 512
+ * bytes, and updates our copy from it. Returns 1 without touching data
+ * if the device wasn't asked because it is a blob or the refresh policy
+ * says no. */
+static int disk_smart_read_data_page(SkDisk *d, uint8_t *data, SkBool *changed) {
         uint16_t cmd[6];
-        int ret;
-
-        if (init_smart(d) < 0)
-                return -1;
+        int r;
+        size_t len = 512;
 
-        if (!disk_smart_is_available(d)) {
-                errno = ENOTSUP;
-                return -1;
-        }
+        if ((r = disk_smart_read_data_prepare(d, changed)) != 0)
+                return r;
 
-        if (d->type == SK_DISK_TYPE_BLOB) {
-                errno = ENOTSUP;
-                return -1;
-        }
+        smart_read_data_cmd(cmd);
 
-        if (!d->smart_data_valid)
-                if ((ret = sk_disk_smart_read_data(d)) < 0)
-                        return -1;
+        if ((r = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_IN, cmd, data, &len)) < 0)
+                return r;
 
-        assert(d->smart_data_valid);
+        return disk_smart_read_data_merge(d, data, changed);
+}
 
-        if (test != SK_SMART_SELF_TEST_SHORT &&
-            test != SK_SMART_SELF_TEST_EXTENDED &&
-            test != SK_SMART_SELF_TEST_CONVEYANCE &&
-            test != SK_SMART_SELF_TEST_ABORT) {
-                errno = EINVAL;
-                return -1;
-        }
+static int disk_smart_read_data_changed_unlocked(SkDisk *d, SkBool *changed) {
+        uint8_t data[512];
 
-        if (!disk_smart_is_start_test_available(d)
-            || (test == SK_SMART_SELF_TEST_ABORT && !disk_smart_is_abort_test_available(d))
-            || ((test == SK_SMART_SELF_TEST_SHORT || test == SK_SMART_SELF_TEST_EXTENDED) && !disk_smart_is_short_and_extended_test_available(d))
-            || (test == SK_SMART_SELF_TEST_CONVEYANCE && !disk_smart_is_conveyance_test_available(d))) {
-                errno = ENOTSUP;
+        if (disk_smart_read_data_page(d, data, changed) < 0)
                 return -1;
-        }
 
-        if (test == SK_SMART_SELF_TEST_ABORT &&
-            !disk_smart_is_abort_test_available(d)) {
-                errno = ENOTSUP;
-                return -1;
-        }
+        return 0;
+}
 
-        memset(cmd, 0, sizeof(cmd));
+int sk_disk_smart_read_data_changed(SkDisk *d, SkBool *changed) {
+        SkBool joined;
+        unsigned seq;
+        int ret;
 
-        cmd[0] = htons(SK_SMART_COMMAND_EXECUTE_OFFLINE_IMMEDIATE);
-        cmd[2] = htons(0x0000U);
-        cmd[3] = htons(0x00C2U);
-        cmd[4] = htons(0x4F00U | (uint16_t) test);
+        assert(d);
+        assert(changed);
 
-        return disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_NONE, cmd, NULL, NULL);
-}
+        if (!disk_coalesces(d)) {
+                *changed = FALSE;
 
-static void swap_strings(char *s, size_t len) {
-        assert((len & 1) == 0);
+                disk_lock(d);
+                ret = disk_smart_read_data_changed_unlocked(d, changed);
+                disk_unlock(d);
 
-        for (; len > 0; s += 2, len -= 2) {
-                char t;
-                t = s[0];
-                s[0] = s[1];
-                s[1] = t;
+                return ret;
         }
-}
-
-static void clean_strings(char *s) {
-        char *e;
-
-        for (e = s; *e; e++)
-                if (*e < ' ' || *e >= 127)
-                        *e = ' ';
-}
 
-static void drop_spaces(char *s) {
-        char *d = s;
-        SkBool prev_space = FALSE;
+        joined = flight_arrive(&d->read_data_flight, &seq);
 
-        s += strspn(s, " ");
+        disk_lock(d);
 
-        for (;*s; s++) {
+        if (!flight_landed(&d->read_data_flight, joined, seq, &ret, changed)) {
+                *changed = FALSE;
 
-                if (prev_space) {
-                        if (*s != ' ') {
-                                prev_space = FALSE;
-                                *(d++) = ' ';
-                                *(d++) = *s;
-                        }
-                } else {
-                        if (*s == ' ')
-                                prev_space = TRUE;
-                        else
-                                *(d++) = *s;
-                }
+                flight_start(&d->read_data_flight);
+                ret = disk_smart_read_data_changed_unlocked(d, changed);
+                flight_finish(&d->read_data_flight, ret, *changed);
         }
 
-        *d = 0;
+        disk_unlock(d);
+
+        return ret;
 }
 
-static void read_string(char *d, uint8_t *s, size_t len) {
-        memcpy(d, s, len);
-        d[len] = 0;
-        swap_strings(d, len);
-        clean_strings(d);
-        drop_spaces(d);
+int sk_disk_smart_read_data(SkDisk *d) {
+        SkBool changed;
+
+        return sk_disk_smart_read_data_changed(d, &changed);
 }
 
-int sk_disk_identify_parse(SkDisk *d, const SkIdentifyParsedData **ipd) {
+static int disk_smart_read_data_into_unlocked(SkDisk *d, void *buf, size_t size, SkBool *changed) {
+        int r;
+
         assert(d);
-        assert(ipd);
+        assert(buf);
+        assert(changed);
 
-        if (!d->identify_valid) {
-                errno = ENOENT;
+        if (size < sizeof(d->smart_data)) {
+                errno = EINVAL;
                 return -1;
         }
 
-        read_string(d->identify_parsed_data.serial, d->identify+20, 20);
-        read_string(d->identify_parsed_data.firmware, d->identify+46, 8);
-        read_string(d->identify_parsed_data.model, d->identify+54, 40);
+        if ((r = disk_smart_read_data_page(d, buf, changed)) < 0)
+                return -1;
 
-        *ipd = &d->identify_parsed_data;
+        if (r > 0) {
+                /* We didn't ask the device, hand out what we have */
+                if (!d->smart_data_valid) {
+                        errno = ENODATA;
+                        return -1;
+                }
+
+                memcpy(buf, d->smart_data, sizeof(d->smart_data));
+        }
 
         return 0;
 }
 
-int sk_disk_smart_is_available(SkDisk *d, SkBool *b) {
+int sk_disk_smart_read_data_into(SkDisk *d, void *buf, size_t size, SkBool *changed) {
+        SkBool dummy;
+        int ret;
+
         assert(d);
-        assert(b);
 
-        if (!d->identify_valid) {
-                errno = ENOTSUP;
-                return -1;
-        }
+        disk_lock(d);
+        ret = disk_smart_read_data_into_unlocked(d, buf, size, changed ? changed : &dummy);
+        disk_unlock(d);
 
-        *b = disk_smart_is_available(d);
-        return 0;
+        return ret;
 }
 
-int sk_disk_identify_is_available(SkDisk *d, SkBool *b) {
+/* Looks up the sg node that belongs to the disk. Only the SAT
+ * transports are handled: they send exactly one SCSI command per ATA
+ * command, while SunPlus and JMicron bridges need several in sequence
+ * and are always driven synchronously. */
+static int disk_sg_open(SkDisk *d) {
+        struct udev *udev = NULL;
+        struct udev_device *dev = NULL, *parent;
+        struct udev_enumerate *e = NULL;
+        struct udev_list_entry *item;
+        struct stat st;
+        int fd = -1, v;
+
         assert(d);
-        assert(b);
 
-        *b = d->identify_valid;
-        return 0;
-}
+        if (d->sg_probed)
+                goto finish;
 
-const char *sk_smart_offline_data_collection_status_to_string(SkSmartOfflineDataCollectionStatus status) {
+        d->sg_probed = TRUE;
 
-        /* %STRINGPOOLSTART% */
-        static const char* const map[] = {
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_NEVER] = "Off-line data collection activity was never started.",
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUCCESS] = "Off-line data collection activity was completed without error.",
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_INPROGRESS] = "Off-line activity in progress.",
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUSPENDED] = "Off-line data collection activity was suspended by an interrupting command from host.",
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_ABORTED] = "Off-line data collection activity was aborted by an interrupting command from host.",
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_FATAL] = "Off-line data collection activity was aborted by the device with a fatal error.",
-                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_UNKNOWN] = "Unknown status"
-        };
-        /* %STRINGPOOLSTOP% */
+        if (d->type != SK_DISK_TYPE_ATA_PASSTHROUGH_12 &&
+            d->type != SK_DISK_TYPE_ATA_PASSTHROUGH_16)
+                goto finish;
 
-        if (status >= _SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_MAX)
-                return NULL;
+        if (fstat(d->fd, &st) < 0)
+                goto finish;
 
-        return _P(map[status]);
-}
+        if (!(udev = udev_new()))
+                goto finish;
 
-const char *sk_smart_self_test_execution_status_to_string(SkSmartSelfTestExecutionStatus status) {
+        if (!(dev = udev_device_new_from_devnum(udev, 'b', st.st_rdev)))
+                goto finish;
 
-        /* %STRINGPOOLSTART% */
-        static const char* const map[] = {
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_SUCCESS_OR_NEVER] = "The previous self-test routine completed without error or no self-test has ever been run.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ABORTED] = "The self-test routine was aborted by the host.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_INTERRUPTED] = "The self-test routine was interrupted by the host with a hardware or software reset.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_FATAL] = "A fatal error or unknown test error occurred while the device was executing its self-test routine and the device was unable to complete the self-test routine.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_UNKNOWN] = "The previous self-test completed having a test element that failed and the test element that failed.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_ELECTRICAL] = "The previous self-test completed having the electrical element of the test failed.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_SERVO] = "The previous self-test completed having the servo (and/or seek) test element of the test failed.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_READ] = "The previous self-test completed having the read element of the test failed.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_HANDLING] = "The previous self-test completed having a test element that failed and the device is suspected of having handling damage.",
-                [SK_SMART_SELF_TEST_EXECUTION_STATUS_INPROGRESS] = "Self-test routine in progress"
-        };
-        /* %STRINGPOOLSTOP% */
+        if (!(parent = udev_device_get_parent_with_subsystem_devtype(dev, "scsi", "scsi_device")))
+                goto finish;
 
-        if (status >= _SK_SMART_SELF_TEST_EXECUTION_STATUS_MAX)
-                return NULL;
+        if (!(e = udev_enumerate_new(udev)))
+                goto finish;
 
-        return _P(map[status]);
-}
+        if (udev_enumerate_add_match_parent(e, parent) < 0 ||
+            udev_enumerate_add_match_subsystem(e, "scsi_generic") < 0 ||
+            udev_enumerate_scan_devices(e) < 0)
+                goto finish;
 
-const char* sk_smart_self_test_to_string(SkSmartSelfTest test) {
+        udev_list_entry_foreach(item, udev_enumerate_get_list_entry(e)) {
+                struct udev_device *sg;
+                const char *node;
 
-        switch (test) {
-                case SK_SMART_SELF_TEST_SHORT:
-                        return "short";
-                case SK_SMART_SELF_TEST_EXTENDED:
-                        return "extended";
-                case SK_SMART_SELF_TEST_CONVEYANCE:
-                        return "conveyance";
-                case SK_SMART_SELF_TEST_ABORT:
-                        return "abort";
+                if (!(sg = udev_device_new_from_syspath(udev, udev_list_entry_get_name(item))))
+                        continue;
+
+                if ((node = udev_device_get_devnode(sg)))
+                        fd = open(node,
+                                  O_RDWR|O_NOCTTY|O_NONBLOCK
+#ifdef O_CLOEXEC
+                                  |O_CLOEXEC
+#endif
+                                );
+
+                udev_device_unref(sg);
+
+                if (fd >= 0)
+                        break;
         }
 
-        return NULL;
-}
+        if (fd < 0)
+                goto finish;
 
-SkBool sk_smart_self_test_available(const SkSmartParsedData *d, SkSmartSelfTest test) {
-        assert(d);
+        /* Writing the header to anything else than an sg device would
+         * be a disaster, so let's make very sure */
+        if (fstat(fd, &st) < 0 ||
+            !S_ISCHR(st.st_mode) ||
+            major(st.st_rdev) != SCSI_GENERIC_MAJOR ||
+            ioctl(fd, SG_GET_VERSION_NUM, &v) < 0 ||
+            v < 30000) {
+                close(fd);
+                goto finish;
+        }
 
-        if (!d->start_test_available)
-                return FALSE;
+        d->sg_fd = fd;
 
-        switch (test) {
-                case SK_SMART_SELF_TEST_SHORT:
-                case SK_SMART_SELF_TEST_EXTENDED:
-                        return d->short_and_extended_test_available;
-                case SK_SMART_SELF_TEST_CONVEYANCE:
-                        return d->conveyance_test_available;
-                case SK_SMART_SELF_TEST_ABORT:
-                        return d->abort_test_available;
-                default:
-                        return FALSE;
+finish:
+        if (e)
+                udev_enumerate_unref(e);
+
+        if (dev)
+                udev_device_unref(dev);
+
+        if (udev)
+                udev_unref(udev);
+
+        if (d->sg_fd < 0) {
+                errno = ENOTSUP;
+                return -1;
         }
+
+        return 0;
 }
 
-unsigned sk_smart_self_test_polling_minutes(const SkSmartParsedData *d, SkSmartSelfTest test) {
+static void disk_async_done(SkDisk *d, int ret, SkBool changed) {
+        d->async_queued = FALSE;
+        d->async_ret = ret;
+        d->async_error = ret < 0 ? errno : 0;
+        d->async_changed = changed;
+}
+
+/* Queues SMART READ DATA on the sg node if we can. Otherwise the
+ * command is executed right away and only its result is kept for
+ * disk_smart_read_data_collect(), unless queue_only is set, in which
+ * case nothing is done and the disk is not pending afterwards. */
+static int disk_smart_read_data_submit(SkDisk *d, SkBool queue_only) {
+        uint16_t cmd[6];
+        SkBool changed = FALSE;
+        size_t cdb_len, len;
+        int r;
+
         assert(d);
 
-        if (!sk_smart_self_test_available(d, test))
+        if (d->async_pending) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        if (queue_only && disk_sg_open(d) < 0)
                 return 0;
 
-        switch (test) {
-                case SK_SMART_SELF_TEST_SHORT:
-                        return d->short_test_polling_minutes;
-                case SK_SMART_SELF_TEST_EXTENDED:
-                        return d->extended_test_polling_minutes;
-                case SK_SMART_SELF_TEST_CONVEYANCE:
-                        return d->conveyance_test_polling_minutes;
-                default:
-                        return 0;
+        d->async_pending = TRUE;
+
+        if ((r = disk_smart_read_data_prepare(d, &changed)) != 0) {
+                disk_async_done(d, r < 0 ? -1 : 0, changed);
+                return 0;
         }
-}
 
-static void make_pretty(SkSmartAttributeParsedData *a) {
-        uint64_t fourtyeight;
+        smart_read_data_cmd(cmd);
 
-        if (!a->name)
-                return;
+        if (disk_sg_open(d) >= 0) {
 
-        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_UNKNOWN)
-                return;
+                if (disk_command_timeout(d, SK_COMMAND_CLASS_READ_DATA, &d->async_timeout) < 0 ||
+                    disk_breaker_check(d) < 0) {
+                        disk_async_done(d, -1, FALSE);
+                        return 0;
+                }
 
-        fourtyeight =
-                ((uint64_t) a->raw[0]) |
-                (((uint64_t) a->raw[1]) << 8) |
-                (((uint64_t) a->raw[2]) << 16) |
-                (((uint64_t) a->raw[3]) << 24) |
-                (((uint64_t) a->raw[4]) << 32) |
-                (((uint64_t) a->raw[5]) << 40);
+                cdb_len = sat_build_cdb(d->type, SK_ATA_COMMAND_SMART, SK_DIRECTION_IN, (const uint8_t*) cmd, d->async_cdb);
 
-        if (!strcmp(a->name, "spin-up-time"))
-                a->pretty_value = fourtyeight & 0xFFFF;
-        else if (!strcmp(a->name, "airflow-temperature-celsius") ||
-                 !strcmp(a->name, "temperature-celsius") ||
-                 !strcmp(a->name, "temperature-celsius-2"))
-                a->pretty_value = (fourtyeight & 0xFFFF)*1000 + 273150;
-        else if (!strcmp(a->name, "temperature-centi-celsius"))
-                a->pretty_value = (fourtyeight & 0xFFFF)*100 + 273150;
-        else if (!strcmp(a->name, "power-on-minutes"))
-                a->pretty_value = fourtyeight * 60 * 1000;
-        else if (!strcmp(a->name, "power-on-seconds") ||
-                 !strcmp(a->name, "power-on-seconds-2"))
-                a->pretty_value = fourtyeight * 1000;
-        else if (!strcmp(a->name, "power-on-half-minutes"))
-                a->pretty_value = fourtyeight * 30 * 1000;
-        else if (!strcmp(a->name, "power-on-hours") ||
-                 !strcmp(a->name, "loaded-hours") ||
-                 !strcmp(a->name, "head-flying-hours"))
-                a->pretty_value = (fourtyeight & 0xFFFFFFFFU) * 60 * 60 * 1000;
-        else if (!strcmp(a->name, "reallocated-sector-count") ||
-                 !strcmp(a->name, "current-pending-sector"))
-                a->pretty_value = fourtyeight & 0xFFFFFFFFU;
-        else if (!strcmp(a->name, "endurance-remaining") ||
-                 !strcmp(a->name, "available-reserved-space"))
-                a->pretty_value = a->current_value;
-        else if (!strcmp(a->name, "total-lbas-written") ||
-                 !strcmp(a->name, "total-lbas-read"))
-                a->pretty_value = fourtyeight * 65536LLU * 512LLU / 1000000LLU;
-        else if (!strcmp(a->name, "timed-workload-media-wear") ||
-                 !strcmp(a->name, "timed-workload-host-reads"))
-                a->pretty_value = (double)fourtyeight / 1024LLU;
-        else if (!strcmp(a->name, "workload-timer"))
-                a->pretty_value = fourtyeight * 60 * 1000;
-        else
-                a->pretty_value = fourtyeight;
-}
+                memset(d->async_sense, 0, sizeof(d->async_sense));
+                memset(d->async_data, 0, sizeof(d->async_data));
+                sg_io_prepare(&d->async_hdr, d->async_timeout, SG_DXFER_FROM_DEV,
+                              d->async_cdb, cdb_len,
+                              d->async_data, sizeof(d->async_data),
+                              d->async_sense, sizeof(d->async_sense));
+                d->async_hdr.usr_ptr = d;
 
-typedef void (*SkSmartAttributeVerify)(SkDisk *d, SkSmartAttributeParsedData *a);
+                if (write(d->sg_fd, &d->async_hdr, sizeof(d->async_hdr)) == (ssize_t) sizeof(d->async_hdr)) {
+                        d->async_queued = TRUE;
+                        d->async_usec = now_usec();
+                        disk_refresh_charge(d);
+                        return 0;
+                }
 
-typedef struct SkSmartAttributeInfo {
-        const char *name;
-        SkSmartAttributeUnit unit;
-        SkSmartAttributeVerify verify;
-} SkSmartAttributeInfo;
+                /* Let the synchronous command below be the probe */
+                d->breaker_probing = FALSE;
+        }
 
-static void verify_temperature(SkDisk *d, SkSmartAttributeParsedData *a) {
-        assert(a);
-        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MKELVIN);
+        len = sizeof(d->async_data);
+        if ((r = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_IN, cmd, d->async_data, &len)) >= 0)
+                r = disk_smart_read_data_merge(d, d->async_data, &changed);
 
-        if (a->pretty_value < SK_MKELVIN_VALID_MIN ||
-            a->pretty_value > SK_MKELVIN_VALID_MAX) {
-                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
-                d->attribute_verification_bad = TRUE;
-        }
+        disk_async_done(d, r, changed);
+        return 0;
 }
 
-static void verify_short_time(SkDisk *d, SkSmartAttributeParsedData *a) {
-        assert(a);
-        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MSECONDS);
+/* Picks up the answer to a queued command. Fails with EAGAIN if it
+ * isn't there yet. */
+static int disk_smart_read_data_reap(SkDisk *d) {
+        uint8_t bytes[12];
+        SkBool changed = FALSE;
+        int r;
 
-        if (a->pretty_value < SK_MSECOND_VALID_MIN ||
-            a->pretty_value > SK_MSECOND_VALID_SHORT_MAX) {
-                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
-                d->attribute_verification_bad = TRUE;
+        assert(d);
+        assert(d->async_queued);
+
+        if (read(d->sg_fd, &d->async_hdr, sizeof(d->async_hdr)) < 0) {
+
+                if (errno == EAGAIN || errno == EINTR) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+
+                disk_async_done(d, -1, FALSE);
+                d->breaker_probing = FALSE;
+                return 0;
         }
+
+        if ((r = sat_check_reply(&d->async_hdr)) >= 0)
+                r = sat_parse_sense(d->async_sense, bytes);
+
+        disk_breaker_record(d, r, errno);
+
+        if (r >= 0)
+                r = disk_smart_read_data_merge(d, d->async_data, &changed);
+
+        disk_async_done(d, r, changed);
+        return 0;
 }
 
-static void verify_long_time(SkDisk *d, SkSmartAttributeParsedData *a) {
-        assert(a);
-        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MSECONDS);
+/* Waits for the queued command to come back. If even that fails we
+ * give up on it and close the sg node, which makes the kernel drop the
+ * reply. It is opened again on next use. */
+static void disk_smart_read_data_drain(SkDisk *d) {
+        struct pollfd p;
 
-        if (a->pretty_value < SK_MSECOND_VALID_MIN ||
-            a->pretty_value > SK_MSECOND_VALID_LONG_MAX) {
-                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
-                d->attribute_verification_bad = TRUE;
+        assert(d);
+
+        while (d->async_queued) {
+
+                if (disk_smart_read_data_reap(d) >= 0)
+                        break;
+
+                p.fd = d->sg_fd;
+                p.events = POLLIN;
+                p.revents = 0;
+
+                if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+                        disk_async_done(d, -1, FALSE);
+                        d->breaker_probing = FALSE;
+
+                        close(d->sg_fd);
+                        d->sg_fd = -1;
+                        d->sg_probed = FALSE;
+                        break;
+                }
         }
 }
 
-static void verify_sectors(SkDisk *d, SkSmartAttributeParsedData *a) {
-        uint64_t max_sectors;
+static int disk_smart_read_data_collect(SkDisk *d, SkBool *changed) {
 
         assert(d);
-        assert(a);
-        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_SECTORS);
+        assert(d->async_pending);
+        assert(!d->async_queued);
 
-        max_sectors = d->size / 512ULL;
+        d->async_pending = FALSE;
+        *changed = d->async_changed;
 
-        if (a->pretty_value == 0xffffffffULL ||
-            a->pretty_value == 0xffffffffffffULL ||
-            (max_sectors > 0 && a->pretty_value > max_sectors)) {
-                a->pretty_value = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
-                d->attribute_verification_bad = TRUE;
-        } else {
-                if ((!strcmp(a->name, "reallocated-sector-count") ||
-                     !strcmp(a->name, "current-pending-sector")) &&
-                    a->pretty_value > 0)
-                        a->warn = TRUE;
-        }
+        if (d->async_ret < 0)
+                errno = d->async_error;
+
+        return d->async_ret;
 }
 
-/* This data is stolen from smartmontools */
+int sk_disk_smart_read_data_parallel(SkDisk **disks, unsigned n, int *errors) {
+        struct pollfd *pollfd;
+        unsigned *idx;
+        unsigned i, k;
+        SkBool changed;
 
-/* %STRINGPOOLSTART% */
-static const SkSmartAttributeInfo const attribute_info[256] = {
-        [1]   = { "raw-read-error-rate",         SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [2]   = { "throughput-performance",      SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [3]   = { "spin-up-time",                SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_short_time },
-        [4]   = { "start-stop-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [5]   = { "reallocated-sector-count",    SK_SMART_ATTRIBUTE_UNIT_SECTORS,  verify_sectors },
-        [6]   = { "read-channel-margin",         SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [7]   = { "seek-error-rate",             SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [8]   = { "seek-time-performance",       SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [9]   = { "power-on-hours",              SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_long_time },
-        [10]  = { "spin-retry-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [11]  = { "calibration-retry-count",     SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [12]  = { "power-cycle-count",           SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [13]  = { "read-soft-error-rate",        SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [170] = { "available-reserved-space",    SK_SMART_ATTRIBUTE_UNIT_PERCENT,  NULL },
-        [171] = { "program-fail-count",          SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [172] = { "erase-fail-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [175] = { "program-fail-count-chip",     SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [176] = { "erase-fail-count-chip",       SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [177] = { "wear-leveling-count",         SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [178] = { "used-reserved-blocks-chip",   SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [179] = { "used-reserved-blocks-total",  SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [180] = { "unused-reserved-blocks",      SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [181] = { "program-fail-count-total",    SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [182] = { "erase-fail-count-total",      SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [183] = { "runtime-bad-block-total",     SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [184] = { "end-to-end-error",            SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [187] = { "reported-uncorrect",          SK_SMART_ATTRIBUTE_UNIT_SECTORS,  verify_sectors },
-        [188] = { "command-timeout",             SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [189] = { "high-fly-writes",             SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [190] = { "airflow-temperature-celsius", SK_SMART_ATTRIBUTE_UNIT_MKELVIN,  verify_temperature },
-        [191] = { "g-sense-error-rate",          SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [192] = { "power-off-retract-count",     SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [193] = { "load-cycle-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [194] = { "temperature-celsius-2",       SK_SMART_ATTRIBUTE_UNIT_MKELVIN,  verify_temperature },
-        [195] = { "hardware-ecc-recovered",      SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [196] = { "reallocated-event-count",     SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [197] = { "current-pending-sector",      SK_SMART_ATTRIBUTE_UNIT_SECTORS,  verify_sectors },
-        [198] = { "offline-uncorrectable",       SK_SMART_ATTRIBUTE_UNIT_SECTORS,  verify_sectors },
-        [199] = { "udma-crc-error-count",        SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [200] = { "multi-zone-error-rate",       SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [201] = { "soft-read-error-rate",        SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [202] = { "ta-increase-count",           SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [203] = { "run-out-cancel",              SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [204] = { "shock-count-write-open",      SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [205] = { "shock-rate-write-open",       SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [206] = { "flying-height",               SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [207] = { "spin-high-current",           SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [208] = { "spin-buzz",                   SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [209] = { "offline-seek-performance",    SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [220] = { "disk-shift",                  SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [221] = { "g-sense-error-rate-2",        SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [222] = { "loaded-hours",                SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_long_time },
-        [223] = { "load-retry-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [224] = { "load-friction",               SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [225] = { "load-cycle-count-2",          SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [226] = { "load-in-time",                SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_short_time },
-        [227] = { "torq-amp-count",              SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [228] = { "power-off-retract-count-2",   SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL },
-        [230] = { "head-amplitude",              SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [231] = { "temperature-celsius",         SK_SMART_ATTRIBUTE_UNIT_MKELVIN,  verify_temperature },
+        assert(disks || n <= 0);
+        assert(errors || n <= 0);
 
-        /* http://www.adtron.com/pdf/SMART_for_XceedLite_SATA_RevA.pdf */
-        [232] = { "endurance-remaining",         SK_SMART_ATTRIBUTE_UNIT_PERCENT,  NULL },
-        [233] = { "power-on-seconds-2",          SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-        [234] = { "uncorrectable-ecc-count",     SK_SMART_ATTRIBUTE_UNIT_SECTORS,  NULL },
-        [235] = { "good-block-rate",             SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,  NULL },
-
-        [240] = { "head-flying-hours",           SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_long_time },
-        [241] = { "total-lbas-written",          SK_SMART_ATTRIBUTE_UNIT_MB,  NULL },
-        [242] = { "total-lbas-read",             SK_SMART_ATTRIBUTE_UNIT_MB,  NULL },
-        [250] = { "read-error-retry-rate",       SK_SMART_ATTRIBUTE_UNIT_NONE,     NULL }
-};
-/* %STRINGPOOLSTOP% */
+        /* One entry per disk, and there are never many of them */
+        pollfd = alloca(sizeof(struct pollfd) * (n+1));
+        idx = alloca(sizeof(unsigned) * (n+1));
 
-typedef enum SkSmartQuirk {
-        SK_SMART_QUIRK_9_POWERONMINUTES            = 0x000001,
-        SK_SMART_QUIRK_9_POWERONSECONDS            = 0x000002,
-        SK_SMART_QUIRK_9_POWERONHALFMINUTES        = 0x000004,
-        SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT = 0x000008,
-        SK_SMART_QUIRK_193_LOADUNLOAD              = 0x000010,
-        SK_SMART_QUIRK_194_10XCELSIUS              = 0x000020,
-        SK_SMART_QUIRK_194_UNKNOWN                 = 0x000040,
-        SK_SMART_QUIRK_200_WRITEERRORCOUNT         = 0x000080,
-        SK_SMART_QUIRK_201_DETECTEDTACOUNT         = 0x000100,
-        SK_SMART_QUIRK_5_UNKNOWN                   = 0x000200,
-        SK_SMART_QUIRK_9_UNKNOWN                   = 0x000400,
-        SK_SMART_QUIRK_197_UNKNOWN                 = 0x000800,
-        SK_SMART_QUIRK_198_UNKNOWN                 = 0x001000,
-        SK_SMART_QUIRK_190_UNKNOWN                 = 0x002000,
-        SK_SMART_QUIRK_232_AVAILABLERESERVEDSPACE  = 0x004000,
-        SK_SMART_QUIRK_233_MEDIAWEAROUTINDICATOR   = 0x008000,
-        SK_SMART_QUIRK_225_TOTALLBASWRITTEN        = 0x010000,
-        SK_SMART_QUIRK_4_UNUSED                    = 0x020000,
-        SK_SMART_QUIRK_226_TIMEWORKLOADMEDIAWEAR   = 0x040000,
-        SK_SMART_QUIRK_227_TIMEWORKLOADHOSTREADS   = 0x080000,
-        SK_SMART_QUIRK_228_WORKLOADTIMER           = 0x100000,
-        SK_SMART_QUIRK_3_UNUSED                    = 0x200000
-} SkSmartQuirk;
+        /* First get everything we can onto the sg nodes, then do the
+         * rest one by one while those are busy */
+        for (i = 0, k = 0; i < n; i++) {
+                disk_lock(disks[i]);
 
-/* %STRINGPOOLSTART% */
-static const char *quirk_name[] = {
-        "9_POWERONMINUTES",
-        "9_POWERONSECONDS",
-        "9_POWERONHALFMINUTES",
-        "192_EMERGENCYRETRACTCYCLECT",
-        "193_LOADUNLOAD",
-        "194_10XCELSIUS",
-        "194_UNKNOWN",
-        "200_WRITEERRORCOUNT",
-        "201_DETECTEDTACOUNT",
-        "5_UNKNOWN",
-        "9_UNKNOWN",
-        "197_UNKNOWN",
-        "198_UNKNOWN",
-        "190_UNKNOWN",
-        "232_AVAILABLERESERVEDSPACE",
-        "233_MEDIAWEAROUTINDICATOR",
-        "225_TOTALLBASWRITTEN",
-        "4_UNUSED",
-        "226_TIMEWORKLOADMEDIAWEAR",
-        "227_TIMEWORKLOADHOSTREADS",
-        "228_WORKLOADTIMER",
-        "3_UNUSED",
-        NULL
-};
-/* %STRINGPOOLSTOP% */
+                if (disk_smart_read_data_submit(disks[i], TRUE) < 0)
+                        errors[i] = errno;
+                else {
+                        errors[i] = 0;
 
-typedef struct SkSmartQuirkDatabase {
-        const char *model;
-        const char *firmware;
-        SkSmartQuirk quirk;
-} SkSmartQuirkDatabase;
+                        if (!disks[i]->async_pending)
+                                idx[k++] = i;
+                }
 
-static const SkSmartQuirkDatabase quirk_database[] = { {
+                disk_unlock(disks[i]);
+        }
 
-        /*** Fujitsu */
-                "^("
-                "FUJITSU MHY2120BH|"
-                "FUJITSU MHY2250BH"
-                ")$",
-                "^0085000B$", /* seems to be specific to this firmware */
-                SK_SMART_QUIRK_9_POWERONMINUTES|
-                SK_SMART_QUIRK_197_UNKNOWN|
-                SK_SMART_QUIRK_198_UNKNOWN
-        }, {
-                "^FUJITSU MHR2040AT$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONSECONDS|
-                SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT|
-                SK_SMART_QUIRK_200_WRITEERRORCOUNT
-        }, {
-                "^FUJITSU MHS20[6432]0AT(  .)?$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONSECONDS|
-                SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT|
-                SK_SMART_QUIRK_200_WRITEERRORCOUNT|
-                SK_SMART_QUIRK_201_DETECTEDTACOUNT
-        }, {
-                "^("
-                "FUJITSU M1623TAU|"
-                "FUJITSU MHG2...ATU?.*|"
-                "FUJITSU MHH2...ATU?.*|"
-                "FUJITSU MHJ2...ATU?.*|"
-                "FUJITSU MHK2...ATU?.*|"
-                "FUJITSU MHL2300AT|"
-                "FUJITSU MHM2(20|15|10|06)0AT|"
-                "FUJITSU MHN2...AT|"
-                "FUJITSU MHR2020AT|"
-                "FUJITSU MHT2...(AH|AS|AT|BH)U?.*|"
-                "FUJITSU MHU2...ATU?.*|"
-                "FUJITSU MHV2...(AH|AS|AT|BH|BS|BT).*|"
-                "FUJITSU MP[A-G]3...A[HTEV]U?.*"
-                ")$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONSECONDS
-        }, {
+        for (i = 0; i < k; i++) {
+                disk_lock(disks[idx[i]]);
+                if (disk_smart_read_data_submit(disks[idx[i]], FALSE) < 0)
+                        errors[idx[i]] = errno;
+                disk_unlock(disks[idx[i]]);
+        }
 
-        /*** Samsung ***/
-                "^("
-                "SAMSUNG SV4012H|"
-                "SAMSUNG SP(0451|08[0124]2|12[0145]3|16[0145]4)[CN]"
-                ")$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONHALFMINUTES
-        }, {
-                "^("
-                "SAMSUNG SV0412H|"
-                "SAMSUNG SV1204H"
-                ")$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONHALFMINUTES|
-                SK_SMART_QUIRK_194_10XCELSIUS
-        }, {
-                "^SAMSUNG SP40A2H$",
-                "^RR100-07$",
-                SK_SMART_QUIRK_9_POWERONHALFMINUTES
-        }, {
-                "^SAMSUNG SP80A4H$",
-                "^RT100-06$",
-                SK_SMART_QUIRK_9_POWERONHALFMINUTES
-        }, {
-                "^SAMSUNG SP8004H$",
-                "^QW100-61$",
-                SK_SMART_QUIRK_9_POWERONHALFMINUTES
-        }, {
+        for (;;) {
+                int r;
 
-        /*** Maxtor */
-                "^("
-                "Maxtor 2B0(0[468]|1[05]|20)H1|"
-                "Maxtor 4G(120J6|160J[68])|"
-                "Maxtor 4D0(20H1|40H2|60H3|80H4)"
-                ")$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONMINUTES|
-                SK_SMART_QUIRK_194_UNKNOWN
-        }, {
-                "^("
-                "Maxtor 2F0[234]0[JL]0|"
-                "Maxtor 8(1280A2|2160A4|2560A4|3840A6|4000A6|5120A8)|"
-                "Maxtor 8(2160D2|3228D3|3240D3|4320D4|6480D6|8400D8|8455D8)|"
-                "Maxtor 9(0510D4|0576D4|0648D5|0720D5|0840D6|0845D6|0864D6|1008D7|1080D8|1152D8)|"
-                "Maxtor 9(1(360|350|202)D8|1190D7|10[12]0D6|0840D5|06[48]0D4|0510D3|1(350|202)E8|1010E6|0840E5|0640E4)|"
-                "Maxtor 9(0512D2|0680D3|0750D3|0913D4|1024D4|1360D6|1536D6|1792D7|2048D8)|"
-                "Maxtor 9(2732U8|2390U7|204[09]U6|1707U5|1366U4|1024U3|0845U3|0683U2)|"
-                "Maxtor 4(R0[68]0[JL]0|R1[26]0L0|A160J0|R120L4)|"
-                "Maxtor (91728D8|91512D7|91303D6|91080D5|90845D4|90645D3|90648D[34]|90432D2)|"
-                "Maxtor 9(0431U1|0641U2|0871U2|1301U3|1741U4)|"
-                "Maxtor (94091U8|93071U6|92561U5|92041U4|91731U4|91531U3|91361U3|91021U2|90841U2|90651U2)|"
-                "Maxtor (33073U4|32049U3|31536U2|30768U1|33073H4|32305H3|31536H2|30768H1)|"
-                "Maxtor (93652U8|92739U6|91826U4|91369U3|90913U2|90845U2|90435U1)|"
-                "Maxtor 9(0684U2|1024U2|1362U3|1536U3|2049U4|2562U5|3073U6|4098U8)|"
-                "Maxtor (54098[UH]8|53073[UH]6|52732[UH]6|52049[UH]4|51536[UH]3|51369[UH]3|51024[UH]2)|"
-                "Maxtor 3(1024H1|1535H2|2049H2|3073H3|4098H4)( B)?|"
-                "Maxtor 5(4610H6|4098H6|3073H4|2049H3|1536H2|1369H2|1023H2)|"
-                "Maxtor 9(1023U2|1536U2|2049U3|2305U3|3073U4|4610U6|6147U8)|"
-                "Maxtor 9(1023H2|1536H2|2049H3|2305H3|3073H4|4098H6|4610H6|6147H8)|"
-                "Maxtor 5T0(60H6|40H4|30H3|20H2|10H1)|"
-                "Maxtor (98196H8|96147H6)|"
-                "Maxtor 4W(100H6|080H6|060H4|040H3|030H2)|"
-                "Maxtor 6(E0[234]|K04)0L0|"
-                "Maxtor 6(B(30|25|20|16|12|10|08)0[MPRS]|L(080[MLP]|(100|120)[MP]|160[MP]|200[MPRS]|250[RS]|300[RS]))0|"
-                "Maxtor 6Y((060|080|120|160)L0|(060|080|120|160|200|250)P0|(060|080|120|160|200|250)M0)|"
-                "Maxtor 7Y250[PM]0|"
-                "Maxtor [45]A(25|30|32)0[JN]0|"
-                "Maxtor 7L(25|30)0[SR]0"
-                ")$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONMINUTES
-        }, {
+                for (i = 0, k = 0; i < n; i++) {
+                        int fd;
 
+                        if (errors[i] != 0)
+                                continue;
 
-        /*** Hitachi */
-                "^("
-                "HITACHI_DK14FA-20B|"
-                "HITACHI_DK23..-..B?|"
-                "HITACHI_DK23FA-20J|HTA422020F9AT[JN]0|"
-                "HE[JN]4230[23]0F9AT00|"
-                "HTC4260[23]0G5CE00|HTC4260[56]0G8CE00"
-                ")$",
-                NULL,
-                SK_SMART_QUIRK_9_POWERONMINUTES|
-                SK_SMART_QUIRK_193_LOADUNLOAD
-        }, {
-                "^HTS541010G9SA00$",
-                "^MBZOC60P$",
-                SK_SMART_QUIRK_5_UNKNOWN
-        }, {
+                        disk_lock(disks[i]);
+                        fd = disks[i]->async_queued ? disks[i]->sg_fd : -1;
+                        disk_unlock(disks[i]);
 
-        /*** Apple SSD (?) http://bugs.freedesktop.org/show_bug.cgi?id=24700
-	                   https://bugs.launchpad.net/ubuntu/+source/gnome-disk-utility/+bug/438136/comments/4 */
-                "^MCCOE64GEMPP$",
-                "^2.9.0[3-9]$",
-                SK_SMART_QUIRK_5_UNKNOWN|
-                SK_SMART_QUIRK_190_UNKNOWN
-        }, {
+                        if (fd < 0)
+                                continue;
 
-        /*** Intel */
-                "^INTEL SSDSA2(CT|BT|CW|BW)[0-9]{3}G3.*$", /* 320 Series */
-                NULL,
-                SK_SMART_QUIRK_3_UNUSED|
-                SK_SMART_QUIRK_4_UNUSED|
-                SK_SMART_QUIRK_225_TOTALLBASWRITTEN|
-                SK_SMART_QUIRK_226_TIMEWORKLOADMEDIAWEAR|
-                SK_SMART_QUIRK_227_TIMEWORKLOADHOSTREADS|
-                SK_SMART_QUIRK_228_WORKLOADTIMER|
-                SK_SMART_QUIRK_232_AVAILABLERESERVEDSPACE|
-                SK_SMART_QUIRK_233_MEDIAWEAROUTINDICATOR
-        }, {
-                NULL,
-                NULL,
-                0
-        }
-};
+                        pollfd[k].fd = fd;
+                        pollfd[k].events = POLLIN;
+                        pollfd[k].revents = 0;
+                        idx[k++] = i;
+                }
 
-static int match(const char*regex, const char *s, SkBool *result) {
-        int k;
-        regex_t re;
+                if (k <= 0)
+                        break;
 
-        *result = FALSE;
+                /* The sg driver enforces the command timeout, so this
+                 * doesn't wait forever */
+                if ((r = poll(pollfd, k, -1)) < 0) {
 
-        if (regcomp(&re, regex, REG_EXTENDED|REG_NOSUB) != 0) {
-                errno = EINVAL;
-                return -1;
-        }
+                        if (errno == EINTR)
+                                continue;
 
-        if ((k = regexec(&re, s, 0, NULL, 0)) != 0) {
+                        /* Wait for each of them on its own instead */
+                        for (i = 0; i < k; i++) {
+                                disk_lock(disks[idx[i]]);
+                                disk_smart_read_data_drain(disks[idx[i]]);
+                                disk_unlock(disks[idx[i]]);
+                        }
 
-                if (k != REG_NOMATCH) {
-                        regfree(&re);
-                        errno = EINVAL;
-                        return -1;
+                        continue;
                 }
 
-        } else
-                *result = TRUE;
+                for (i = 0; i < k; i++) {
+                        if (!pollfd[i].revents)
+                                continue;
+
+                        disk_lock(disks[idx[i]]);
+                        disk_smart_read_data_reap(disks[idx[i]]);
+                        disk_unlock(disks[idx[i]]);
+                }
+        }
 
-        regfree(&re);
+        for (i = 0; i < n; i++) {
+                if (errors[i] != 0)
+                        continue;
+
+                disk_lock(disks[i]);
+                if (disk_smart_read_data_collect(disks[i], &changed) < 0)
+                        errors[i] = errno;
+                disk_unlock(disks[i]);
+        }
 
         return 0;
 }
 
-static int lookup_quirks(const char *model, const char *firmware, SkSmartQuirk *quirk) {
-        int k;
-        const SkSmartQuirkDatabase *db;
+int sk_disk_smart_read_data_begin(SkDisk *d) {
+        int ret;
 
-        *quirk = 0;
+        assert(d);
 
-        for (db = quirk_database; db->model || db->firmware; db++) {
+        disk_lock(d);
+        ret = disk_smart_read_data_submit(d, FALSE);
+        disk_unlock(d);
 
-                if (db->model) {
-                        SkBool matching = FALSE;
+        return ret;
+}
 
-                        if ((k = match(db->model, model, &matching)) < 0)
-                                return k;
+static int disk_smart_read_data_finish_unlocked(SkDisk *d, SkBool *changed) {
 
-                        if (!matching)
-                                continue;
-                }
+        if (!d->async_pending) {
+                errno = EINVAL;
+                return -1;
+        }
 
-                if (db->firmware) {
-                        SkBool matching = FALSE;
+        if (d->async_queued)
+                if (disk_smart_read_data_reap(d) < 0)
+                        return -1;
 
-                        if ((k = match(db->firmware, firmware, &matching)) < 0)
-                                return k;
+        return disk_smart_read_data_collect(d, changed);
+}
 
-                        if (!matching)
-                                continue;
-                }
+int sk_disk_smart_read_data_finish(SkDisk *d, SkBool *changed) {
+        SkBool dummy;
+        int ret;
 
-                *quirk = db->quirk;
-                return 0;
-        }
+        assert(d);
 
-        return 0;
+        disk_lock(d);
+        ret = disk_smart_read_data_finish_unlocked(d, changed ? changed : &dummy);
+        disk_unlock(d);
+
+        return ret;
 }
 
-static const SkSmartAttributeInfo *lookup_attribute(SkDisk *d, uint8_t id) {
-        const SkIdentifyParsedData *ipd;
-        SkSmartQuirk quirk = 0;
+int sk_disk_get_poll_fd(SkDisk *d, int *fd) {
+        assert(d);
+        assert(fd);
 
-        /* These are the complex ones */
-        if (sk_disk_identify_parse(d, &ipd) < 0)
-                return NULL;
+        disk_lock(d);
+        *fd = d->async_queued ? d->sg_fd : -1;
+        disk_unlock(d);
 
-        if (lookup_quirks(ipd->model, ipd->firmware, &quirk) < 0)
-                return NULL;
+        return 0;
+}
 
-        if (quirk) {
-                switch (id) {
-                        case 3:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_3_UNUSED) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "spin-up-time", SK_SMART_ATTRIBUTE_UNIT_UNKNOWN, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+int sk_disk_get_timeout_hint(SkDisk *d, uint64_t *usec) {
+        uint64_t n, until;
 
-                                break;
+        assert(d);
+        assert(usec);
 
-                        case 4:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_4_UNUSED) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "start-stop-count", SK_SMART_ATTRIBUTE_UNIT_UNKNOWN, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+        disk_lock(d);
 
-                                break;
+        if (!d->async_queued)
+                *usec = 0;
+        else {
+                n = now_usec();
+                until = d->async_usec + d->async_timeout * 1000ULL;
+                *usec = until > n ? until - n : 0;
+        }
 
-                        case 5:
-                                if (quirk & SK_SMART_QUIRK_5_UNKNOWN)
-                                        return NULL;
+        disk_unlock(d);
 
-                                break;
+        return 0;
+}
 
-                        case 9:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_9_POWERONMINUTES) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "power-on-minutes", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_long_time
-                                        };
-                                        return &a;
+static int disk_smart_read_thresholds(SkDisk *d) {
+        uint16_t cmd[6];
+        uint8_t thresholds[512];
+        int ret;
+        size_t len = 512;
 
-                                } else if (quirk & SK_SMART_QUIRK_9_POWERONSECONDS) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "power-on-seconds", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_long_time
-                                        };
-                                        return &a;
+        if (!disk_smart_is_available(d)) {
+                errno = ENOTSUP;
+                return -1;
+        }
 
-                                } else if (quirk & SK_SMART_QUIRK_9_POWERONHALFMINUTES) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "power-on-half-minutes", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, verify_long_time
-                                        };
-                                        return &a;
-                                } else if (quirk & SK_SMART_QUIRK_9_UNKNOWN)
-                                        return NULL;
-                                /* %STRINGPOOLSTOP% */
+        if (d->type == SK_DISK_TYPE_BLOB)
+                return 0;
+
+        memset(cmd, 0, sizeof(cmd));
+
+        cmd[0] = htons(SK_SMART_COMMAND_READ_THRESHOLDS);
+        cmd[1] = htons(1);
+        cmd[2] = htons(0x0000U);
+        cmd[3] = htons(0x00C2U);
+        cmd[4] = htons(0x4F00U);
+
+        if ((ret = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_IN, cmd, thresholds, &len)) < 0)
+                return ret;
+
+        if (d->smart_thresholds_valid &&
+            memcmp(thresholds, d->smart_thresholds, sizeof(thresholds)) == 0)
+                return ret;
+
+        memcpy(d->smart_thresholds, thresholds, sizeof(d->smart_thresholds));
+        build_attribute_index(d->smart_thresholds, d->smart_thresholds_index);
+        d->smart_thresholds_valid = TRUE;
+        disk_new_generation(d);
+
+        return ret;
+}
+
+static int disk_smart_status_unlocked(SkDisk *d, SkBool *good) {
+        uint16_t cmd[6];
+        int ret;
+
+        if (init_smart(d) < 0)
+                return -1;
+
+        if (!disk_smart_is_available(d)) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        if (d->type == SK_DISK_TYPE_BLOB) {
+
+                if (d->blob_smart_status_valid) {
+                        *good = d->blob_smart_status;
+                        return 0;
+                }
+
+                errno = ENXIO;
+                return -1;
+        }
+
+        if (!disk_refresh_allowed(d, d->status_valid ? d->status_usec : 0)) {
+
+                if (!d->status_valid) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+
+                *good = d->status_good;
+                return 0;
+        }
+
+        memset(cmd, 0, sizeof(cmd));
+
+        cmd[0] = htons(SK_SMART_COMMAND_RETURN_STATUS);
+        cmd[1] = htons(0x0000U);
+        cmd[3] = htons(0x00C2U);
+        cmd[4] = htons(0x4F00U);
+
+        if ((ret = disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_NONE, cmd, NULL, 0)) < 0)
+                return ret;
+
+        /* SAT/USB bridges truncate packets, so we only check for 4F,
+         * not for 2C on those */
+        if ((d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_12 || cmd[3] == htons(0x00C2U)) &&
+            cmd[4] == htons(0x4F00U))
+                *good = TRUE;
+        else if ((d->type == SK_DISK_TYPE_ATA_PASSTHROUGH_12 || cmd[3] == htons(0x002CU)) &&
+                 cmd[4] == htons(0xF400U))
+                *good = FALSE;
+        else {
+                errno = EIO;
+                return -1;
+        }
+
+        d->status_good = *good;
+        d->status_valid = TRUE;
+        d->status_usec = now_usec();
+
+        return ret;
+}
+
+int sk_disk_smart_status(SkDisk *d, SkBool *good) {
+        SkBool joined;
+        unsigned seq;
+        int ret;
+
+        assert(d);
+        assert(good);
+
+        if (!disk_coalesces(d)) {
+                *good = FALSE;
+
+                disk_lock(d);
+                ret = disk_smart_status_unlocked(d, good);
+                disk_unlock(d);
+
+                return ret;
+        }
+
+        joined = flight_arrive(&d->status_flight, &seq);
+
+        disk_lock(d);
+
+        if (!flight_landed(&d->status_flight, joined, seq, &ret, good)) {
+                *good = FALSE;
+
+                flight_start(&d->status_flight);
+                ret = disk_smart_status_unlocked(d, good);
+                flight_finish(&d->status_flight, ret, *good);
+        }
+
+        disk_unlock(d);
+
+        return ret;
+}
+
+/* Uses the SMART status we have if it was read after the current
+ * SMART data, or within the status TTL. Otherwise asks the disk. */
+static int disk_smart_status_cached(SkDisk *d, SkBool *good) {
+
+        if (d->type != SK_DISK_TYPE_BLOB && d->status_valid) {
+
+                if ((d->smart_data_usec > 0 && d->status_usec >= d->smart_data_usec) ||
+                    (d->status_ttl_usec > 0 && now_usec() - d->status_usec < d->status_ttl_usec)) {
+                        *good = d->status_good;
+                        return 0;
+                }
+        }
+
+        return sk_disk_smart_status(d, good);
+}
+
+int sk_disk_set_status_ttl(SkDisk *d, uint64_t usec) {
+        assert(d);
+
+        disk_lock(d);
+        d->status_ttl_usec = usec;
+        disk_unlock(d);
+
+        return 0;
+}
+
+static int disk_smart_self_test_unlocked(SkDisk *d, SkSmartSelfTest test) {
+        uint16_t cmd[6];
+        int ret;
+
+        if (init_smart(d) < 0)
+                return -1;
+
+        if (!disk_smart_is_available(d)) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        if (d->type == SK_DISK_TYPE_BLOB) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        if (!d->smart_data_valid)
+                if ((ret = sk_disk_smart_read_data(d)) < 0)
+                        return -1;
+
+        assert(d->smart_data_valid);
+
+        if (test != SK_SMART_SELF_TEST_SHORT &&
+            test != SK_SMART_SELF_TEST_EXTENDED &&
+            test != SK_SMART_SELF_TEST_CONVEYANCE &&
+            test != SK_SMART_SELF_TEST_ABORT) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (!disk_smart_is_start_test_available(d)
+            || (test == SK_SMART_SELF_TEST_ABORT && !disk_smart_is_abort_test_available(d))
+            || ((test == SK_SMART_SELF_TEST_SHORT || test == SK_SMART_SELF_TEST_EXTENDED) && !disk_smart_is_short_and_extended_test_available(d))
+            || (test == SK_SMART_SELF_TEST_CONVEYANCE && !disk_smart_is_conveyance_test_available(d))) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        if (test == SK_SMART_SELF_TEST_ABORT &&
+            !disk_smart_is_abort_test_available(d)) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        memset(cmd, 0, sizeof(cmd));
+
+        cmd[0] = htons(SK_SMART_COMMAND_EXECUTE_OFFLINE_IMMEDIATE);
+        cmd[2] = htons(0x0000U);
+        cmd[3] = htons(0x00C2U);
+        cmd[4] = htons(0x4F00U | (uint16_t) test);
+
+        return disk_command(d, SK_ATA_COMMAND_SMART, SK_DIRECTION_NONE, cmd, NULL, NULL);
+}
+
+int sk_disk_smart_self_test(SkDisk *d, SkSmartSelfTest test) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_self_test_unlocked(d, test);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static void swap_strings(char *s, size_t len) {
+        assert((len & 1) == 0);
+
+        for (; len > 0; s += 2, len -= 2) {
+                char t;
+                t = s[0];
+                s[0] = s[1];
+                s[1] = t;
+        }
+}
+
+static void clean_strings(char *s) {
+        char *e;
+
+        for (e = s; *e; e++)
+                if (*e < ' ' || *e >= 127)
+                        *e = ' ';
+}
+
+static void drop_spaces(char *s) {
+        char *d = s;
+        SkBool prev_space = FALSE;
+
+        s += strspn(s, " ");
+
+        for (;*s; s++) {
+
+                if (prev_space) {
+                        if (*s != ' ') {
+                                prev_space = FALSE;
+                                *(d++) = ' ';
+                                *(d++) = *s;
+                        }
+                } else {
+                        if (*s == ' ')
+                                prev_space = TRUE;
+                        else
+                                *(d++) = *s;
+                }
+        }
+
+        *d = 0;
+}
+
+static void read_string(char *d, uint8_t *s, size_t len) {
+        memcpy(d, s, len);
+        d[len] = 0;
+        swap_strings(d, len);
+        clean_strings(d);
+        drop_spaces(d);
+}
+
+static void disk_identify_invalidate(SkDisk *d) {
+        d->identify_parsed_data_valid = FALSE;
+        d->quirks_valid = FALSE;
+}
+
+static int disk_identify_parse_unlocked(SkDisk *d, const SkIdentifyParsedData **ipd) {
+        assert(d);
+        assert(ipd);
+
+        if (!d->identify_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        if (!d->identify_parsed_data_valid) {
+                read_string(d->identify_parsed_data.serial, d->identify+20, 20);
+                read_string(d->identify_parsed_data.firmware, d->identify+46, 8);
+                read_string(d->identify_parsed_data.model, d->identify+54, 40);
+
+                d->identify_parsed_data_valid = TRUE;
+        }
+
+        *ipd = &d->identify_parsed_data;
+
+        return 0;
+}
+
+int sk_disk_identify_parse(SkDisk *d, const SkIdentifyParsedData **ipd) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_identify_parse_unlocked(d, ipd);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_is_available_unlocked(SkDisk *d, SkBool *b) {
+        assert(d);
+        assert(b);
+
+        if (!d->identify_valid) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        *b = disk_smart_is_available(d);
+        return 0;
+}
+
+int sk_disk_smart_is_available(SkDisk *d, SkBool *b) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_is_available_unlocked(d, b);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_identify_is_available_unlocked(SkDisk *d, SkBool *b) {
+        assert(d);
+        assert(b);
+
+        *b = d->identify_valid;
+        return 0;
+}
+
+int sk_disk_identify_is_available(SkDisk *d, SkBool *b) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_identify_is_available_unlocked(d, b);
+        disk_unlock(d);
+
+        return ret;
+}
+
+const char *sk_smart_offline_data_collection_status_to_string(SkSmartOfflineDataCollectionStatus status) {
+
+        /* %STRINGPOOLSTART% */
+        static const char* const map[] = {
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_NEVER] = "Off-line data collection activity was never started.",
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUCCESS] = "Off-line data collection activity was completed without error.",
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_INPROGRESS] = "Off-line activity in progress.",
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUSPENDED] = "Off-line data collection activity was suspended by an interrupting command from host.",
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_ABORTED] = "Off-line data collection activity was aborted by an interrupting command from host.",
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_FATAL] = "Off-line data collection activity was aborted by the device with a fatal error.",
+                [SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_UNKNOWN] = "Unknown status"
+        };
+        /* %STRINGPOOLSTOP% */
+
+        if (status >= _SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_MAX)
+                return NULL;
+
+        return _P(map[status]);
+}
+
+const char *sk_smart_self_test_execution_status_to_string(SkSmartSelfTestExecutionStatus status) {
+
+        /* %STRINGPOOLSTART% */
+        static const char* const map[] = {
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_SUCCESS_OR_NEVER] = "The previous self-test routine completed without error or no self-test has ever been run.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ABORTED] = "The self-test routine was aborted by the host.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_INTERRUPTED] = "The self-test routine was interrupted by the host with a hardware or software reset.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_FATAL] = "A fatal error or unknown test error occurred while the device was executing its self-test routine and the device was unable to complete the self-test routine.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_UNKNOWN] = "The previous self-test completed having a test element that failed and the test element that failed.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_ELECTRICAL] = "The previous self-test completed having the electrical element of the test failed.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_SERVO] = "The previous self-test completed having the servo (and/or seek) test element of the test failed.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_READ] = "The previous self-test completed having the read element of the test failed.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_ERROR_HANDLING] = "The previous self-test completed having a test element that failed and the device is suspected of having handling damage.",
+                [SK_SMART_SELF_TEST_EXECUTION_STATUS_INPROGRESS] = "Self-test routine in progress"
+        };
+        /* %STRINGPOOLSTOP% */
+
+        if (status >= _SK_SMART_SELF_TEST_EXECUTION_STATUS_MAX)
+                return NULL;
+
+        return _P(map[status]);
+}
+
+const char* sk_smart_self_test_to_string(SkSmartSelfTest test) {
+
+        switch (test) {
+                case SK_SMART_SELF_TEST_SHORT:
+                        return "short";
+                case SK_SMART_SELF_TEST_EXTENDED:
+                        return "extended";
+                case SK_SMART_SELF_TEST_CONVEYANCE:
+                        return "conveyance";
+                case SK_SMART_SELF_TEST_ABORT:
+                        return "abort";
+        }
+
+        return NULL;
+}
+
+SkBool sk_smart_self_test_available(const SkSmartParsedData *d, SkSmartSelfTest test) {
+        assert(d);
+
+        if (!d->start_test_available)
+                return FALSE;
+
+        switch (test) {
+                case SK_SMART_SELF_TEST_SHORT:
+                case SK_SMART_SELF_TEST_EXTENDED:
+                        return d->short_and_extended_test_available;
+                case SK_SMART_SELF_TEST_CONVEYANCE:
+                        return d->conveyance_test_available;
+                case SK_SMART_SELF_TEST_ABORT:
+                        return d->abort_test_available;
+                default:
+                        return FALSE;
+        }
+}
+
+unsigned sk_smart_self_test_polling_minutes(const SkSmartParsedData *d, SkSmartSelfTest test) {
+        assert(d);
+
+        if (!sk_smart_self_test_available(d, test))
+                return 0;
+
+        switch (test) {
+                case SK_SMART_SELF_TEST_SHORT:
+                        return d->short_test_polling_minutes;
+                case SK_SMART_SELF_TEST_EXTENDED:
+                        return d->extended_test_polling_minutes;
+                case SK_SMART_SELF_TEST_CONVEYANCE:
+                        return d->conveyance_test_polling_minutes;
+                default:
+                        return 0;
+        }
+}
+
+/* How to convert the raw value of an attribute into its pretty value */
+typedef enum SkSmartDecoder {
+        SK_SMART_DECODER_RAW48,          /* 48 bit raw value */
+        SK_SMART_DECODER_RAW32,          /* lower 32 bit of the raw value */
+        SK_SMART_DECODER_RAW16,          /* lower 16 bit of the raw value */
+        SK_SMART_DECODER_CELSIUS,        /* lower 16 bit, in degrees Celsius */
+        SK_SMART_DECODER_CENTI_CELSIUS,  /* lower 16 bit, in 1/10 degrees Celsius */
+        SK_SMART_DECODER_SECONDS,
+        SK_SMART_DECODER_HALF_MINUTES,
+        SK_SMART_DECODER_MINUTES,
+        SK_SMART_DECODER_HOURS,          /* lower 32 bit, in hours */
+        SK_SMART_DECODER_CURRENT_VALUE,  /* the normalized value, not the raw one */
+        SK_SMART_DECODER_LBAS_32MIB,     /* in units of 65536 sectors */
+        SK_SMART_DECODER_PER_1024,       /* in units of 1/1024 */
+        _SK_SMART_DECODER_MAX
+} SkSmartDecoder;
+
+static void make_pretty(SkSmartAttributeParsedData *a, SkSmartDecoder decoder) {
+        uint64_t fourtyeight;
+
+        if (!a->name)
+                return;
+
+        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_UNKNOWN)
+                return;
+
+        fourtyeight =
+                ((uint64_t) a->raw[0]) |
+                (((uint64_t) a->raw[1]) << 8) |
+                (((uint64_t) a->raw[2]) << 16) |
+                (((uint64_t) a->raw[3]) << 24) |
+                (((uint64_t) a->raw[4]) << 32) |
+                (((uint64_t) a->raw[5]) << 40);
+
+        switch (decoder) {
+
+                case SK_SMART_DECODER_RAW32:
+                        a->pretty_value = fourtyeight & 0xFFFFFFFFU;
+                        break;
+
+                case SK_SMART_DECODER_RAW16:
+                        a->pretty_value = fourtyeight & 0xFFFF;
+                        break;
+
+                case SK_SMART_DECODER_CELSIUS:
+                        a->pretty_value = (fourtyeight & 0xFFFF)*1000 + 273150;
+                        break;
+
+                case SK_SMART_DECODER_CENTI_CELSIUS:
+                        a->pretty_value = (fourtyeight & 0xFFFF)*100 + 273150;
+                        break;
+
+                case SK_SMART_DECODER_SECONDS:
+                        a->pretty_value = fourtyeight * 1000;
+                        break;
+
+                case SK_SMART_DECODER_HALF_MINUTES:
+                        a->pretty_value = fourtyeight * 30 * 1000;
+                        break;
+
+                case SK_SMART_DECODER_MINUTES:
+                        a->pretty_value = fourtyeight * 60 * 1000;
+                        break;
+
+                case SK_SMART_DECODER_HOURS:
+                        a->pretty_value = (fourtyeight & 0xFFFFFFFFU) * 60 * 60 * 1000;
+                        break;
+
+                case SK_SMART_DECODER_CURRENT_VALUE:
+                        a->pretty_value = a->current_value;
+                        break;
+
+                case SK_SMART_DECODER_LBAS_32MIB:
+                        a->pretty_value = fourtyeight * 65536LLU * 512LLU / 1000000LLU;
+                        break;
+
+                case SK_SMART_DECODER_PER_1024:
+                        a->pretty_value = (double)fourtyeight / 1024LLU;
+                        break;
+
+                case SK_SMART_DECODER_RAW48:
+                default:
+                        a->pretty_value = fourtyeight;
+                        break;
+        }
+}
+
+typedef void (*SkSmartAttributeVerify)(SkDisk *d, SkSmartAttributeParsedData *a);
+
+typedef struct SkSmartAttributeInfo {
+        const char *name;
+        SkSmartAttributeUnit unit;
+        SkSmartAttributeRole role;
+        SkSmartDecoder decoder;
+        SkSmartAttributeVerify verify;
+} SkSmartAttributeInfo;
+
+static void disk_attribute_verification_failed(SkDisk *d) {
+
+        /* Snapshots are read from several threads at once, so only
+         * write if this actually changes something */
+        if (!d->attribute_verification_bad)
+                d->attribute_verification_bad = TRUE;
+}
+
+static void verify_temperature(SkDisk *d, SkSmartAttributeParsedData *a) {
+        assert(a);
+        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MKELVIN);
+
+        if (a->pretty_value < SK_MKELVIN_VALID_MIN ||
+            a->pretty_value > SK_MKELVIN_VALID_MAX) {
+                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
+                disk_attribute_verification_failed(d);
+        }
+}
+
+static void verify_short_time(SkDisk *d, SkSmartAttributeParsedData *a) {
+        assert(a);
+        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MSECONDS);
+
+        if (a->pretty_value < SK_MSECOND_VALID_MIN ||
+            a->pretty_value > SK_MSECOND_VALID_SHORT_MAX) {
+                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
+                disk_attribute_verification_failed(d);
+        }
+}
+
+static void verify_long_time(SkDisk *d, SkSmartAttributeParsedData *a) {
+        assert(a);
+        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MSECONDS);
+
+        if (a->pretty_value < SK_MSECOND_VALID_MIN ||
+            a->pretty_value > SK_MSECOND_VALID_LONG_MAX) {
+                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
+                disk_attribute_verification_failed(d);
+        }
+}
+
+static void verify_sectors(SkDisk *d, SkSmartAttributeParsedData *a) {
+        uint64_t max_sectors;
+
+        assert(d);
+        assert(a);
+        assert(a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_SECTORS);
+
+        max_sectors = d->size / 512ULL;
+
+        if (a->pretty_value == 0xffffffffULL ||
+            a->pretty_value == 0xffffffffffffULL ||
+            (max_sectors > 0 && a->pretty_value > max_sectors)) {
+                a->pretty_value = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
+                disk_attribute_verification_failed(d);
+        }
+}
+
+/* Like verify_sectors(), but any bad sector at all is worth a warning */
+static void verify_bad_sectors(SkDisk *d, SkSmartAttributeParsedData *a) {
+        verify_sectors(d, a);
+
+        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_SECTORS &&
+            a->pretty_value > 0)
+                a->warn = TRUE;
+}
+
+/* This data is stolen from smartmontools */
+
+/* %STRINGPOOLSTART% */
+static const SkSmartAttributeInfo const attribute_info[256] = {
+        [1]   = { "raw-read-error-rate",         SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [2]   = { "throughput-performance",      SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [3]   = { "spin-up-time",                SK_SMART_ATTRIBUTE_UNIT_MSECONDS,  SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW16,          verify_short_time },
+        [4]   = { "start-stop-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [5]   = { "reallocated-sector-count",    SK_SMART_ATTRIBUTE_UNIT_SECTORS,   SK_SMART_ATTRIBUTE_ROLE_REALLOCATED_SECTORS,   SK_SMART_DECODER_RAW32,          verify_bad_sectors },
+        [6]   = { "read-channel-margin",         SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [7]   = { "seek-error-rate",             SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [8]   = { "seek-time-performance",       SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [9]   = { "power-on-hours",              SK_SMART_ATTRIBUTE_UNIT_MSECONDS,  SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME,         SK_SMART_DECODER_HOURS,          verify_long_time },
+        [10]  = { "spin-retry-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [11]  = { "calibration-retry-count",     SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [12]  = { "power-cycle-count",           SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_POWER_CYCLES,          SK_SMART_DECODER_RAW48,          NULL },
+        [13]  = { "read-soft-error-rate",        SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [170] = { "available-reserved-space",    SK_SMART_ATTRIBUTE_UNIT_PERCENT,   SK_SMART_ATTRIBUTE_ROLE_RESERVED_SPACE,        SK_SMART_DECODER_CURRENT_VALUE,  NULL },
+        [171] = { "program-fail-count",          SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [172] = { "erase-fail-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [175] = { "program-fail-count-chip",     SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [176] = { "erase-fail-count-chip",       SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [177] = { "wear-leveling-count",         SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_WEAR,                  SK_SMART_DECODER_RAW48,          NULL },
+        [178] = { "used-reserved-blocks-chip",   SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [179] = { "used-reserved-blocks-total",  SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [180] = { "unused-reserved-blocks",      SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_RESERVED_SPACE,        SK_SMART_DECODER_RAW48,          NULL },
+        [181] = { "program-fail-count-total",    SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [182] = { "erase-fail-count-total",      SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [183] = { "runtime-bad-block-total",     SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [184] = { "end-to-end-error",            SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [187] = { "reported-uncorrect",          SK_SMART_ATTRIBUTE_UNIT_SECTORS,   SK_SMART_ATTRIBUTE_ROLE_UNCORRECTABLE_SECTORS, SK_SMART_DECODER_RAW48,          verify_sectors },
+        [188] = { "command-timeout",             SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [189] = { "high-fly-writes",             SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [190] = { "airflow-temperature-celsius", SK_SMART_ATTRIBUTE_UNIT_MKELVIN,   SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE,           SK_SMART_DECODER_CELSIUS,        verify_temperature },
+        [191] = { "g-sense-error-rate",          SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [192] = { "power-off-retract-count",     SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [193] = { "load-cycle-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [194] = { "temperature-celsius-2",       SK_SMART_ATTRIBUTE_UNIT_MKELVIN,   SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE,           SK_SMART_DECODER_CELSIUS,        verify_temperature },
+        [195] = { "hardware-ecc-recovered",      SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [196] = { "reallocated-event-count",     SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [197] = { "current-pending-sector",      SK_SMART_ATTRIBUTE_UNIT_SECTORS,   SK_SMART_ATTRIBUTE_ROLE_PENDING_SECTORS,       SK_SMART_DECODER_RAW32,          verify_bad_sectors },
+        [198] = { "offline-uncorrectable",       SK_SMART_ATTRIBUTE_UNIT_SECTORS,   SK_SMART_ATTRIBUTE_ROLE_UNCORRECTABLE_SECTORS, SK_SMART_DECODER_RAW48,          verify_sectors },
+        [199] = { "udma-crc-error-count",        SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [200] = { "multi-zone-error-rate",       SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [201] = { "soft-read-error-rate",        SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [202] = { "ta-increase-count",           SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [203] = { "run-out-cancel",              SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [204] = { "shock-count-write-open",      SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [205] = { "shock-rate-write-open",       SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [206] = { "flying-height",               SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [207] = { "spin-high-current",           SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [208] = { "spin-buzz",                   SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [209] = { "offline-seek-performance",    SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [220] = { "disk-shift",                  SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [221] = { "g-sense-error-rate-2",        SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [222] = { "loaded-hours",                SK_SMART_ATTRIBUTE_UNIT_MSECONDS,  SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_HOURS,          verify_long_time },
+        [223] = { "load-retry-count",            SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [224] = { "load-friction",               SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [225] = { "load-cycle-count-2",          SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [226] = { "load-in-time",                SK_SMART_ATTRIBUTE_UNIT_MSECONDS,  SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          verify_short_time },
+        [227] = { "torq-amp-count",              SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [228] = { "power-off-retract-count-2",   SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [230] = { "head-amplitude",              SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+        [231] = { "temperature-celsius",         SK_SMART_ATTRIBUTE_UNIT_MKELVIN,   SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE,           SK_SMART_DECODER_CELSIUS,        verify_temperature },
+
+        /* http://www.adtron.com/pdf/SMART_for_XceedLite_SATA_RevA.pdf */
+        [232] = { "endurance-remaining",         SK_SMART_ATTRIBUTE_UNIT_PERCENT,   SK_SMART_ATTRIBUTE_ROLE_WEAR,                  SK_SMART_DECODER_CURRENT_VALUE,  NULL },
+        [233] = { "power-on-seconds-2",          SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME,         SK_SMART_DECODER_SECONDS,        NULL },
+        [234] = { "uncorrectable-ecc-count",     SK_SMART_ATTRIBUTE_UNIT_SECTORS,   SK_SMART_ATTRIBUTE_ROLE_UNCORRECTABLE_SECTORS, SK_SMART_DECODER_RAW48,          NULL },
+        [235] = { "good-block-rate",             SK_SMART_ATTRIBUTE_UNIT_UNKNOWN,   SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL },
+
+        [240] = { "head-flying-hours",           SK_SMART_ATTRIBUTE_UNIT_MSECONDS,  SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_HOURS,          verify_long_time },
+        [241] = { "total-lbas-written",          SK_SMART_ATTRIBUTE_UNIT_MB,        SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_LBAS_32MIB,     NULL },
+        [242] = { "total-lbas-read",             SK_SMART_ATTRIBUTE_UNIT_MB,        SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_LBAS_32MIB,     NULL },
+        [250] = { "read-error-retry-rate",       SK_SMART_ATTRIBUTE_UNIT_NONE,      SK_SMART_ATTRIBUTE_ROLE_NONE,                  SK_SMART_DECODER_RAW48,          NULL }
+};
+/* %STRINGPOOLSTOP% */
+
+/* %STRINGPOOLSTART% */
+static const char *quirk_name[] = {
+        "9_POWERONMINUTES",
+        "9_POWERONSECONDS",
+        "9_POWERONHALFMINUTES",
+        "192_EMERGENCYRETRACTCYCLECT",
+        "193_LOADUNLOAD",
+        "194_10XCELSIUS",
+        "194_UNKNOWN",
+        "200_WRITEERRORCOUNT",
+        "201_DETECTEDTACOUNT",
+        "5_UNKNOWN",
+        "9_UNKNOWN",
+        "197_UNKNOWN",
+        "198_UNKNOWN",
+        "190_UNKNOWN",
+        "232_AVAILABLERESERVEDSPACE",
+        "233_MEDIAWEAROUTINDICATOR",
+        "225_TOTALLBASWRITTEN",
+        "4_UNUSED",
+        "226_TIMEWORKLOADMEDIAWEAR",
+        "227_TIMEWORKLOADHOSTREADS",
+        "228_WORKLOADTIMER",
+        "3_UNUSED",
+        NULL
+};
+/* %STRINGPOOLSTOP% */
+
+typedef struct SkSmartQuirkDatabase {
+        const char *model;
+        const char *firmware;
+        SkSmartQuirk quirk;
+} SkSmartQuirkDatabase;
+
+static const SkSmartQuirkDatabase quirk_database[] = { {
+
+        /*** Fujitsu */
+                "^("
+                "FUJITSU MHY2120BH|"
+                "FUJITSU MHY2250BH"
+                ")$",
+                "^0085000B$", /* seems to be specific to this firmware */
+                SK_SMART_QUIRK_9_POWERONMINUTES|
+                SK_SMART_QUIRK_197_UNKNOWN|
+                SK_SMART_QUIRK_198_UNKNOWN
+        }, {
+                "^FUJITSU MHR2040AT$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONSECONDS|
+                SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT|
+                SK_SMART_QUIRK_200_WRITEERRORCOUNT
+        }, {
+                "^FUJITSU MHS20[6432]0AT(  .)?$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONSECONDS|
+                SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT|
+                SK_SMART_QUIRK_200_WRITEERRORCOUNT|
+                SK_SMART_QUIRK_201_DETECTEDTACOUNT
+        }, {
+                "^("
+                "FUJITSU M1623TAU|"
+                "FUJITSU MHG2...ATU?.*|"
+                "FUJITSU MHH2...ATU?.*|"
+                "FUJITSU MHJ2...ATU?.*|"
+                "FUJITSU MHK2...ATU?.*|"
+                "FUJITSU MHL2300AT|"
+                "FUJITSU MHM2(20|15|10|06)0AT|"
+                "FUJITSU MHN2...AT|"
+                "FUJITSU MHR2020AT|"
+                "FUJITSU MHT2...(AH|AS|AT|BH)U?.*|"
+                "FUJITSU MHU2...ATU?.*|"
+                "FUJITSU MHV2...(AH|AS|AT|BH|BS|BT).*|"
+                "FUJITSU MP[A-G]3...A[HTEV]U?.*"
+                ")$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONSECONDS
+        }, {
+
+        /*** Samsung ***/
+                "^("
+                "SAMSUNG SV4012H|"
+                "SAMSUNG SP(0451|08[0124]2|12[0145]3|16[0145]4)[CN]"
+                ")$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONHALFMINUTES
+        }, {
+                "^("
+                "SAMSUNG SV0412H|"
+                "SAMSUNG SV1204H"
+                ")$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONHALFMINUTES|
+                SK_SMART_QUIRK_194_10XCELSIUS
+        }, {
+                "^SAMSUNG SP40A2H$",
+                "^RR100-07$",
+                SK_SMART_QUIRK_9_POWERONHALFMINUTES
+        }, {
+                "^SAMSUNG SP80A4H$",
+                "^RT100-06$",
+                SK_SMART_QUIRK_9_POWERONHALFMINUTES
+        }, {
+                "^SAMSUNG SP8004H$",
+                "^QW100-61$",
+                SK_SMART_QUIRK_9_POWERONHALFMINUTES
+        }, {
+
+        /*** Maxtor */
+                "^("
+                "Maxtor 2B0(0[468]|1[05]|20)H1|"
+                "Maxtor 4G(120J6|160J[68])|"
+                "Maxtor 4D0(20H1|40H2|60H3|80H4)"
+                ")$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONMINUTES|
+                SK_SMART_QUIRK_194_UNKNOWN
+        }, {
+                "^("
+                "Maxtor 2F0[234]0[JL]0|"
+                "Maxtor 8(1280A2|2160A4|2560A4|3840A6|4000A6|5120A8)|"
+                "Maxtor 8(2160D2|3228D3|3240D3|4320D4|6480D6|8400D8|8455D8)|"
+                "Maxtor 9(0510D4|0576D4|0648D5|0720D5|0840D6|0845D6|0864D6|1008D7|1080D8|1152D8)|"
+                "Maxtor 9(1(360|350|202)D8|1190D7|10[12]0D6|0840D5|06[48]0D4|0510D3|1(350|202)E8|1010E6|0840E5|0640E4)|"
+                "Maxtor 9(0512D2|0680D3|0750D3|0913D4|1024D4|1360D6|1536D6|1792D7|2048D8)|"
+                "Maxtor 9(2732U8|2390U7|204[09]U6|1707U5|1366U4|1024U3|0845U3|0683U2)|"
+                "Maxtor 4(R0[68]0[JL]0|R1[26]0L0|A160J0|R120L4)|"
+                "Maxtor (91728D8|91512D7|91303D6|91080D5|90845D4|90645D3|90648D[34]|90432D2)|"
+                "Maxtor 9(0431U1|0641U2|0871U2|1301U3|1741U4)|"
+                "Maxtor (94091U8|93071U6|92561U5|92041U4|91731U4|91531U3|91361U3|91021U2|90841U2|90651U2)|"
+                "Maxtor (33073U4|32049U3|31536U2|30768U1|33073H4|32305H3|31536H2|30768H1)|"
+                "Maxtor (93652U8|92739U6|91826U4|91369U3|90913U2|90845U2|90435U1)|"
+                "Maxtor 9(0684U2|1024U2|1362U3|1536U3|2049U4|2562U5|3073U6|4098U8)|"
+                "Maxtor (54098[UH]8|53073[UH]6|52732[UH]6|52049[UH]4|51536[UH]3|51369[UH]3|51024[UH]2)|"
+                "Maxtor 3(1024H1|1535H2|2049H2|3073H3|4098H4)( B)?|"
+                "Maxtor 5(4610H6|4098H6|3073H4|2049H3|1536H2|1369H2|1023H2)|"
+                "Maxtor 9(1023U2|1536U2|2049U3|2305U3|3073U4|4610U6|6147U8)|"
+                "Maxtor 9(1023H2|1536H2|2049H3|2305H3|3073H4|4098H6|4610H6|6147H8)|"
+                "Maxtor 5T0(60H6|40H4|30H3|20H2|10H1)|"
+                "Maxtor (98196H8|96147H6)|"
+                "Maxtor 4W(100H6|080H6|060H4|040H3|030H2)|"
+                "Maxtor 6(E0[234]|K04)0L0|"
+                "Maxtor 6(B(30|25|20|16|12|10|08)0[MPRS]|L(080[MLP]|(100|120)[MP]|160[MP]|200[MPRS]|250[RS]|300[RS]))0|"
+                "Maxtor 6Y((060|080|120|160)L0|(060|080|120|160|200|250)P0|(060|080|120|160|200|250)M0)|"
+                "Maxtor 7Y250[PM]0|"
+                "Maxtor [45]A(25|30|32)0[JN]0|"
+                "Maxtor 7L(25|30)0[SR]0"
+                ")$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONMINUTES
+        }, {
+
+
+        /*** Hitachi */
+                "^("
+                "HITACHI_DK14FA-20B|"
+                "HITACHI_DK23..-..B?|"
+                "HITACHI_DK23FA-20J|HTA422020F9AT[JN]0|"
+                "HE[JN]4230[23]0F9AT00|"
+                "HTC4260[23]0G5CE00|HTC4260[56]0G8CE00"
+                ")$",
+                NULL,
+                SK_SMART_QUIRK_9_POWERONMINUTES|
+                SK_SMART_QUIRK_193_LOADUNLOAD
+        }, {
+                "^HTS541010G9SA00$",
+                "^MBZOC60P$",
+                SK_SMART_QUIRK_5_UNKNOWN
+        }, {
+
+        /*** Apple SSD (?) http://bugs.freedesktop.org/show_bug.cgi?id=24700
+	                   https://bugs.launchpad.net/ubuntu/+source/gnome-disk-utility/+bug/438136/comments/4 */
+                "^MCCOE64GEMPP$",
+                "^2.9.0[3-9]$",
+                SK_SMART_QUIRK_5_UNKNOWN|
+                SK_SMART_QUIRK_190_UNKNOWN
+        }, {
+
+        /*** Intel */
+                "^INTEL SSDSA2(CT|BT|CW|BW)[0-9]{3}G3.*$", /* 320 Series */
+                NULL,
+                SK_SMART_QUIRK_3_UNUSED|
+                SK_SMART_QUIRK_4_UNUSED|
+                SK_SMART_QUIRK_225_TOTALLBASWRITTEN|
+                SK_SMART_QUIRK_226_TIMEWORKLOADMEDIAWEAR|
+                SK_SMART_QUIRK_227_TIMEWORKLOADHOSTREADS|
+                SK_SMART_QUIRK_228_WORKLOADTIMER|
+                SK_SMART_QUIRK_232_AVAILABLERESERVEDSPACE|
+                SK_SMART_QUIRK_233_MEDIAWEAROUTINDICATOR
+        }, {
+                NULL,
+                NULL,
+                0
+        }
+};
+
+typedef struct SkSmartQuirkRegex {
+        regex_t model;
+        regex_t firmware;
+} SkSmartQuirkRegex;
+
+/* Compiling the regular expressions is by far the most expensive part
+ * of the quirk lookup, hence we do it only once per process, the
+ * first time the database is consulted. */
+static pthread_once_t quirk_regex_once = PTHREAD_ONCE_INIT;
+static SkSmartQuirkRegex quirk_regex[ELEMENTSOF(quirk_database)];
+static SkBool quirk_regex_valid = FALSE;
+
+static void quirk_regex_free_until(const SkSmartQuirkDatabase *end) {
+        const SkSmartQuirkDatabase *db;
+        SkSmartQuirkRegex *r;
+
+        for (db = quirk_database, r = quirk_regex; db < end; db++, r++) {
+                if (db->model)
+                        regfree(&r->model);
+
+                if (db->firmware)
+                        regfree(&r->firmware);
+        }
+}
+
+static void quirk_regex_compile(void) {
+        const SkSmartQuirkDatabase *db;
+        SkSmartQuirkRegex *r;
+
+        for (db = quirk_database, r = quirk_regex; db->model || db->firmware; db++, r++) {
+
+                if (db->model)
+                        if (regcomp(&r->model, db->model, REG_EXTENDED|REG_NOSUB) != 0)
+                                goto fail;
+
+                if (db->firmware)
+                        if (regcomp(&r->firmware, db->firmware, REG_EXTENDED|REG_NOSUB) != 0) {
+                                if (db->model)
+                                        regfree(&r->model);
+                                goto fail;
+                        }
+        }
+
+        quirk_regex_valid = TRUE;
+        return;
+
+fail:
+        quirk_regex_free_until(db);
+}
+
+static void quirk_regex_free(void) __attribute__((destructor));
+
+static void quirk_regex_free(void) {
+        const SkSmartQuirkDatabase *db;
+
+        if (!quirk_regex_valid)
+                return;
+
+        for (db = quirk_database; db->model || db->firmware; db++)
+                ;
+
+        quirk_regex_free_until(db);
+        quirk_regex_valid = FALSE;
+}
+
+static int match(const regex_t *re, const char *s, SkBool *result) {
+        int k;
+
+        *result = FALSE;
+
+        if ((k = regexec(re, s, 0, NULL, 0)) != 0) {
+
+                if (k != REG_NOMATCH) {
+                        errno = EINVAL;
+                        return -1;
+                }
+
+        } else
+                *result = TRUE;
+
+        return 0;
+}
+
+static int lookup_quirks(const char *model, const char *firmware, SkSmartQuirk *quirk) {
+        int k;
+        const SkSmartQuirkDatabase *db;
+        const SkSmartQuirkRegex *r;
+
+        *quirk = 0;
+
+        if ((k = pthread_once(&quirk_regex_once, quirk_regex_compile)) != 0) {
+                errno = k;
+                return -1;
+        }
+
+        if (!quirk_regex_valid) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        for (db = quirk_database, r = quirk_regex; db->model || db->firmware; db++, r++) {
+
+                if (db->model) {
+                        SkBool matching = FALSE;
+
+                        if ((k = match(&r->model, model, &matching)) < 0)
+                                return k;
+
+                        if (!matching)
+                                continue;
+                }
+
+                if (db->firmware) {
+                        SkBool matching = FALSE;
+
+                        if ((k = match(&r->firmware, firmware, &matching)) < 0)
+                                return k;
+
+                        if (!matching)
+                                continue;
+                }
+
+                *quirk = db->quirk;
+                return 0;
+        }
+
+        return 0;
+}
+
+/* Looks up the quirks of this disk, the result is cached until the
+ * IDENTIFY data is rewritten */
+static int disk_lookup_quirks(SkDisk *d, SkSmartQuirk *quirk) {
+
+        if (!d->quirks_valid) {
+                const SkIdentifyParsedData *ipd;
+
+                if (sk_disk_identify_parse(d, &ipd) < 0)
+                        return -1;
+
+                if (lookup_quirks(ipd->model, ipd->firmware, &d->quirks) < 0)
+                        return -1;
+
+                d->quirks_valid = TRUE;
+        }
+
+        *quirk = d->quirks;
+        return 0;
+}
+
+static const SkSmartAttributeInfo *lookup_attribute(SkDisk *d, uint8_t id) {
+        SkSmartQuirk quirk = 0;
+
+        /* These are the complex ones */
+        if (disk_lookup_quirks(d, &quirk) < 0)
+                return NULL;
+
+        if (quirk) {
+                switch (id) {
+                        case 3:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_3_UNUSED) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "spin-up-time", SK_SMART_ATTRIBUTE_UNIT_UNKNOWN, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_RAW16, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 4:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_4_UNUSED) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "start-stop-count", SK_SMART_ATTRIBUTE_UNIT_UNKNOWN, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_RAW48, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 5:
+                                if (quirk & SK_SMART_QUIRK_5_UNKNOWN)
+                                        return NULL;
+
+                                break;
+
+                        case 9:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_9_POWERONMINUTES) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "power-on-minutes", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME, SK_SMART_DECODER_MINUTES, verify_long_time
+                                        };
+                                        return &a;
+
+                                } else if (quirk & SK_SMART_QUIRK_9_POWERONSECONDS) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "power-on-seconds", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME, SK_SMART_DECODER_SECONDS, verify_long_time
+                                        };
+                                        return &a;
+
+                                } else if (quirk & SK_SMART_QUIRK_9_POWERONHALFMINUTES) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "power-on-half-minutes", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME, SK_SMART_DECODER_HALF_MINUTES, verify_long_time
+                                        };
+                                        return &a;
+                                } else if (quirk & SK_SMART_QUIRK_9_UNKNOWN)
+                                        return NULL;
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 190:
+                                if (quirk & SK_SMART_QUIRK_190_UNKNOWN)
+                                        return NULL;
+
+                                break;
+
+                        case 192:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "emergency-retract-cycle-count", SK_SMART_ATTRIBUTE_UNIT_NONE, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_RAW48, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 194:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_194_10XCELSIUS) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "temperature-centi-celsius", SK_SMART_ATTRIBUTE_UNIT_MKELVIN, SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE, SK_SMART_DECODER_CENTI_CELSIUS, verify_temperature
+                                        };
+                                        return &a;
+                                } else if (quirk & SK_SMART_QUIRK_194_UNKNOWN)
+                                        return NULL;
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 197:
+                                if (quirk & SK_SMART_QUIRK_197_UNKNOWN)
+                                        return NULL;
+
+                                break;
+
+                        case 198:
+                                if (quirk & SK_SMART_QUIRK_198_UNKNOWN)
+                                        return NULL;
+
+                                break;
+
+                        case 200:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_200_WRITEERRORCOUNT) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "write-error-count", SK_SMART_ATTRIBUTE_UNIT_NONE, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_RAW48, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 201:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_201_DETECTEDTACOUNT) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "detected-ta-count", SK_SMART_ATTRIBUTE_UNIT_NONE, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_RAW48, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 225:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_225_TOTALLBASWRITTEN) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "total-lbas-written", SK_SMART_ATTRIBUTE_UNIT_MB, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_LBAS_32MIB, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 226:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_226_TIMEWORKLOADMEDIAWEAR) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "timed-workload-media-wear", SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT, SK_SMART_ATTRIBUTE_ROLE_WEAR, SK_SMART_DECODER_PER_1024, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 227:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_227_TIMEWORKLOADHOSTREADS) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "timed-workload-host-reads", SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_PER_1024, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 228:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_228_WORKLOADTIMER) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "workload-timer", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, SK_SMART_ATTRIBUTE_ROLE_NONE, SK_SMART_DECODER_MINUTES, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+
+                                break;
+
+                        case 232:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_232_AVAILABLERESERVEDSPACE) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "available-reserved-space", SK_SMART_ATTRIBUTE_UNIT_PERCENT, SK_SMART_ATTRIBUTE_ROLE_RESERVED_SPACE, SK_SMART_DECODER_CURRENT_VALUE, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+                                break;
+
+                        case 233:
+                                /* %STRINGPOOLSTART% */
+                                if (quirk & SK_SMART_QUIRK_233_MEDIAWEAROUTINDICATOR) {
+                                        static const SkSmartAttributeInfo a = {
+                                                "media-wearout-indicator", SK_SMART_ATTRIBUTE_UNIT_PERCENT, SK_SMART_ATTRIBUTE_ROLE_WEAR, SK_SMART_DECODER_RAW48, NULL
+                                        };
+                                        return &a;
+                                }
+                                /* %STRINGPOOLSTOP% */
+                                break;
+
+                }
+        }
+
+        /* These are the simple cases */
+        if (attribute_info[id].name)
+                return &attribute_info[id];
+
+        return NULL;
+}
+
+static int disk_smart_parse_unlocked(SkDisk *d, const SkSmartParsedData **spd) {
+
+        if (!d->smart_data_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        if (d->smart_parsed_data_generation == d->generation) {
+                *spd = &d->smart_parsed_data;
+                return 0;
+        }
+
+        switch (d->smart_data[362]) {
+                case 0x00:
+                case 0x80:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_NEVER;
+                        break;
+
+                case 0x02:
+                case 0x82:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUCCESS;
+                        break;
+
+                case 0x03:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_INPROGRESS;
+                        break;
+
+                case 0x04:
+                case 0x84:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUSPENDED;
+                        break;
+
+                case 0x05:
+                case 0x85:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_ABORTED;
+                        break;
+
+                case 0x06:
+                case 0x86:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_FATAL;
+                        break;
+
+                default:
+                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_UNKNOWN;
+                        break;
+        }
+
+        d->smart_parsed_data.self_test_execution_percent_remaining = 10*(d->smart_data[363] & 0xF);
+        d->smart_parsed_data.self_test_execution_status = (d->smart_data[363] >> 4) & 0xF;
+
+        d->smart_parsed_data.total_offline_data_collection_seconds = (uint16_t) d->smart_data[364] | ((uint16_t) d->smart_data[365] << 8);
+
+        d->smart_parsed_data.conveyance_test_available = disk_smart_is_conveyance_test_available(d);
+        d->smart_parsed_data.short_and_extended_test_available = disk_smart_is_short_and_extended_test_available(d);
+        d->smart_parsed_data.start_test_available = disk_smart_is_start_test_available(d);
+        d->smart_parsed_data.abort_test_available = disk_smart_is_abort_test_available(d);
+
+        d->smart_parsed_data.short_test_polling_minutes = d->smart_data[372];
+        d->smart_parsed_data.extended_test_polling_minutes = d->smart_data[373] != 0xFF ? d->smart_data[373] : ((uint16_t) d->smart_data[376] << 8 | (uint16_t) d->smart_data[375]);
+        d->smart_parsed_data.conveyance_test_polling_minutes = d->smart_data[374];
+
+        d->smart_parsed_data_generation = d->generation;
+        *spd = &d->smart_parsed_data;
+
+        return 0;
+}
+
+int sk_disk_smart_parse(SkDisk *d, const SkSmartParsedData **spd) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_parse_unlocked(d, spd);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static void build_attribute_index(const uint8_t *page, uint8_t index[256]) {
+        const uint8_t *p;
+        unsigned n;
+
+        memset(index, 0, 256);
+
+        /* If an ID is listed more than once, the first entry wins */
+        for (n = 0, p = page+2; n < 30; n++, p+=12)
+                if (p[0] != 0 && index[p[0]] == 0)
+                        index[p[0]] = (uint8_t) (n+1);
+}
+
+static void find_threshold(SkDisk *d, SkSmartAttributeParsedData *a) {
+        uint8_t *p;
+        unsigned n;
+
+        if (!d->smart_thresholds_valid)
+                goto fail;
+
+        if (!(n = d->smart_thresholds_index[a->id]))
+                goto fail;
+
+        p = d->smart_thresholds + 2 + (n-1)*12;
+
+        a->threshold = p[1];
+        a->threshold_valid = p[1] != 0xFE;
+
+        a->good_now_valid = FALSE;
+        a->good_now = TRUE;
+        a->good_in_the_past_valid = FALSE;
+        a->good_in_the_past = TRUE;
+
+        /* Always-Fail and Always-Passing thresholds are not relevant
+         * for our assessment. */
+        if (p[1] >= 1 && p[1] <= 0xFD) {
+
+                if (a->worst_value_valid) {
+                        a->good_in_the_past = a->good_in_the_past && (a->worst_value > a->threshold);
+                        a->good_in_the_past_valid = TRUE;
+                }
+
+                if (a->current_value_valid) {
+                        a->good_now = a->good_now && (a->current_value > a->threshold);
+                        a->good_now_valid = TRUE;
+                }
+        }
+
+        a->warn =
+                (a->good_now_valid && !a->good_now) ||
+                (a->good_in_the_past_valid && !a->good_in_the_past);
+
+        return;
+
+fail:
+        a->threshold_valid = FALSE;
+        a->good_now_valid = FALSE;
+        a->good_in_the_past_valid = FALSE;
+        a->warn = FALSE;
+}
+
+/* Names for attributes we don't know, formatted only once per
+ * process, so that parsing never needs to allocate memory */
+static pthread_once_t unknown_attribute_names_once = PTHREAD_ONCE_INIT;
+static char unknown_attribute_names[256][sizeof("attribute-255")];
+
+static void unknown_attribute_names_fill(void) {
+        unsigned u;
+
+        for (u = 0; u < ELEMENTSOF(unknown_attribute_names); u++)
+                snprintf(unknown_attribute_names[u], sizeof(unknown_attribute_names[u]), "attribute-%u", u);
+}
+
+static const char *unknown_attribute_name(uint8_t id) {
+        pthread_once(&unknown_attribute_names_once, unknown_attribute_names_fill);
+
+        return unknown_attribute_names[id];
+}
+
+/* Decodes the attribute stored at p in the SMART data page */
+static const SkSmartAttributeInfo *disk_smart_parse_attribute(SkDisk *d, const uint8_t *p, SkSmartAttributeParsedData *a) {
+        const SkSmartAttributeInfo *i;
+
+        memset(a, 0, sizeof(*a));
+        a->id = p[0];
+        a->current_value = p[3];
+        a->current_value_valid = p[3] >= 1 && p[3] <= 0xFD;
+        a->worst_value = p[4];
+        a->worst_value_valid = p[4] >= 1 && p[4] <= 0xFD;
+
+        a->flags = ((uint16_t) p[2] << 8) | p[1];
+        a->prefailure = !!(p[1] & 1);
+        a->online = !!(p[1] & 2);
+
+        memcpy(a->raw, p+5, 6);
+
+        if ((i = lookup_attribute(d, p[0]))) {
+                a->name = _P(i->name);
+                a->pretty_unit = i->unit;
+                a->role = i->role;
+        } else {
+                a->name = unknown_attribute_name(p[0]);
+                a->pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
+        }
+
+        make_pretty(a, i ? i->decoder : SK_SMART_DECODER_RAW48);
+
+        find_threshold(d, a);
+
+        if (i && i->verify)
+                i->verify(d, a);
+
+        return i;
+}
+
+static int disk_smart_parse_attributes_unlocked(SkDisk *d, SkSmartAttributeParseCallback cb, void* userdata) {
+        const uint8_t *p;
+        unsigned n;
+
+        if (!d->smart_data_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        for (n = 0, p = d->smart_data + 2; n < 30; n++, p+=12) {
+                SkSmartAttributeParsedData a;
+
+                if (p[0] == 0)
+                        continue;
+
+                disk_smart_parse_attribute(d, p, &a);
+
+                cb(d, &a, userdata);
+        }
+
+        return 0;
+}
+
+int sk_disk_smart_parse_attributes(SkDisk *d, SkSmartAttributeParseCallback cb, void* userdata) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_parse_attributes_unlocked(d, cb, userdata);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_parse_attributes_masked_unlocked(SkDisk *d, const uint8_t mask[SK_SMART_ATTRIBUTE_MASK_SIZE], SkSmartAttributeParseCallback cb, void* userdata) {
+        uint8_t pending[SK_SMART_ATTRIBUTE_MASK_SIZE];
+        const uint8_t *p;
+        unsigned n, left = 0;
+
+        assert(d);
+        assert(mask);
+        assert(cb);
+
+        if (!d->smart_data_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        memcpy(pending, mask, sizeof(pending));
+
+        for (n = 0; n < 256; n++)
+                if (SK_SMART_ATTRIBUTE_MASK_TEST(pending, n))
+                        left++;
+
+        for (n = 0, p = d->smart_data + 2; n < 30 && left > 0; n++, p+=12) {
+                SkSmartAttributeParsedData a;
+
+                /* Only decode what was asked for, and every ID only once */
+                if (p[0] == 0 || !SK_SMART_ATTRIBUTE_MASK_TEST(pending, p[0]))
+                        continue;
+
+                pending[p[0] >> 3] &= (uint8_t) ~(1U << (p[0] & 7));
+                left--;
+
+                disk_smart_parse_attribute(d, p, &a);
+
+                cb(d, &a, userdata);
+        }
+
+        return 0;
+}
+
+int sk_disk_smart_parse_attributes_masked(SkDisk *d, const uint8_t mask[SK_SMART_ATTRIBUTE_MASK_SIZE], SkSmartAttributeParseCallback cb, void* userdata) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_parse_attributes_masked_unlocked(d, mask, cb, userdata);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_get_attribute_unlocked(SkDisk *d, uint8_t id, SkSmartAttributeParsedData *a) {
+        unsigned n;
+
+        assert(d);
+        assert(a);
+
+        if (!d->smart_data_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        if (id == 0 || !(n = d->smart_data_index[id])) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        disk_smart_parse_attribute(d, d->smart_data + 2 + (n-1)*12, a);
+        return 0;
+}
+
+int sk_disk_smart_get_attribute(SkDisk *d, uint8_t id, SkSmartAttributeParsedData *a) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_attribute_unlocked(d, id, a);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_get_attributes_unlocked(SkDisk *d, SkSmartAttributeParsedData *a, size_t n_max, size_t *n) {
+        const uint8_t *p;
+        unsigned k;
+        size_t m = 0;
+
+        assert(d);
+        assert(a || n_max <= 0);
+        assert(n);
+
+        *n = 0;
+
+        if (!d->smart_data_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        for (k = 0, p = d->smart_data + 2; k < 30; k++, p+=12) {
+
+                if (p[0] == 0)
+                        continue;
+
+                if (m >= n_max) {
+                        errno = ENOBUFS;
+                        return -1;
+                }
+
+                disk_smart_parse_attribute(d, p, a+m);
+
+                *n = ++m;
+        }
+
+        return 0;
+}
+
+int sk_disk_smart_get_attributes(SkDisk *d, SkSmartAttributeParsedData *a, size_t n_max, size_t *n) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_attributes_unlocked(d, a, n_max, n);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static const char *yes_no(SkBool b) {
+        return  b ? "yes" : "no";
+}
+
+const char* sk_smart_attribute_unit_to_string(SkSmartAttributeUnit unit) {
+
+        /* %STRINGPOOLSTART% */
+        const char * const map[] = {
+                [SK_SMART_ATTRIBUTE_UNIT_UNKNOWN] = NULL,
+                [SK_SMART_ATTRIBUTE_UNIT_NONE] = "",
+                [SK_SMART_ATTRIBUTE_UNIT_MSECONDS] = "ms",
+                [SK_SMART_ATTRIBUTE_UNIT_SECTORS] = "sectors",
+                [SK_SMART_ATTRIBUTE_UNIT_MKELVIN] = "mK",
+                [SK_SMART_ATTRIBUTE_UNIT_PERCENT] = "%",
+                [SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT] = "%",
+                [SK_SMART_ATTRIBUTE_UNIT_MB] = "MB"
+        };
+        /* %STRINGPOOLSTOP% */
+
+        if (unit >= _SK_SMART_ATTRIBUTE_UNIT_MAX)
+                return NULL;
+
+        return _P(map[unit]);
+}
+
+const char* sk_smart_attribute_role_to_string(SkSmartAttributeRole role) {
+
+        /* %STRINGPOOLSTART% */
+        const char * const map[] = {
+                [SK_SMART_ATTRIBUTE_ROLE_NONE] = NULL,
+                [SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE] = "temperature",
+                [SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME] = "power-on-time",
+                [SK_SMART_ATTRIBUTE_ROLE_POWER_CYCLES] = "power-cycles",
+                [SK_SMART_ATTRIBUTE_ROLE_REALLOCATED_SECTORS] = "reallocated-sectors",
+                [SK_SMART_ATTRIBUTE_ROLE_PENDING_SECTORS] = "pending-sectors",
+                [SK_SMART_ATTRIBUTE_ROLE_UNCORRECTABLE_SECTORS] = "uncorrectable-sectors",
+                [SK_SMART_ATTRIBUTE_ROLE_WEAR] = "wear",
+                [SK_SMART_ATTRIBUTE_ROLE_RESERVED_SPACE] = "reserved-space"
+        };
+        /* %STRINGPOOLSTOP% */
+
+        if (role >= _SK_SMART_ATTRIBUTE_ROLE_MAX)
+                return NULL;
+
+        return _P(map[role]);
+}
+
+static void summary_cb(SkDisk *d, const SkSmartAttributeParsedData *a, SkSmartSummary *s) {
+
+        if (a->prefailure) {
+                if (a->good_now_valid && !a->good_now)
+                        s->bad_attribute_now = TRUE;
+
+                if (a->good_in_the_past_valid && !a->good_in_the_past)
+                        s->bad_attribute_in_the_past = TRUE;
+        }
+
+        /* The unit is checked as well, since verification resets it
+         * for implausible values */
+        switch (a->role) {
+
+                case SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE:
+
+                        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MKELVIN) {
+
+                                if (!s->temperature_valid || a->pretty_value > s->temperature_mkelvin)
+                                        s->temperature_mkelvin = a->pretty_value;
+
+                                s->temperature_valid = TRUE;
+                        }
+
+                        break;
+
+                case SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME:
+
+                        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_MSECONDS) {
+
+                                if (!s->power_on_valid || a->pretty_value > s->power_on_mseconds)
+                                        s->power_on_mseconds = a->pretty_value;
+
+                                s->power_on_valid = TRUE;
+                        }
+
+                        break;
+
+                case SK_SMART_ATTRIBUTE_ROLE_POWER_CYCLES:
+
+                        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_NONE) {
+
+                                if (!s->power_cycle_valid || a->pretty_value > s->power_cycle_count)
+                                        s->power_cycle_count = a->pretty_value;
+
+                                s->power_cycle_valid = TRUE;
+                        }
+
+                        break;
+
+                case SK_SMART_ATTRIBUTE_ROLE_REALLOCATED_SECTORS:
+
+                        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_SECTORS) {
+                                if (a->pretty_value > s->reallocated_sector_count)
+                                        s->reallocated_sector_count = a->pretty_value;
+                                s->reallocated_sector_count_valid = TRUE;
+                        }
+
+                        break;
+
+                case SK_SMART_ATTRIBUTE_ROLE_PENDING_SECTORS:
+
+                        if (a->pretty_unit == SK_SMART_ATTRIBUTE_UNIT_SECTORS) {
+                                if (a->pretty_value > s->current_pending_sector)
+                                        s->current_pending_sector = a->pretty_value;
+                                s->current_pending_sector_valid = TRUE;
+                        }
+
+                        break;
+
+                default:
+                        break;
+        }
+}
+
+static int disk_smart_get_summary_unlocked(SkDisk *d, const SkSmartSummary **summary) {
+        SkSmartSummary s;
+
+        assert(d);
+        assert(summary);
+
+        if (d->summary_generation != d->generation) {
+                memset(&s, 0, sizeof(s));
+
+                if (sk_disk_smart_parse_attributes(d, (SkSmartAttributeParseCallback) summary_cb, &s) < 0)
+                        return -1;
+
+                d->summary = s;
+                d->summary_generation = d->generation;
+        }
+
+        *summary = &d->summary;
+        return 0;
+}
+
+int sk_disk_smart_get_summary(SkDisk *d, const SkSmartSummary **summary) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_summary_unlocked(d, summary);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_get_temperature_unlocked(SkDisk *d, uint64_t *kelvin) {
+        const SkSmartSummary *s;
+
+        assert(d);
+        assert(kelvin);
+
+        if (sk_disk_smart_get_summary(d, &s) < 0)
+                return -1;
+
+        if (!s->temperature_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        *kelvin = s->temperature_mkelvin;
+        return 0;
+}
+
+int sk_disk_smart_get_temperature(SkDisk *d, uint64_t *kelvin) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_temperature_unlocked(d, kelvin);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_get_power_on_unlocked(SkDisk *d, uint64_t *mseconds) {
+        const SkSmartSummary *s;
+
+        assert(d);
+        assert(mseconds);
+
+        if (sk_disk_smart_get_summary(d, &s) < 0)
+                return -1;
+
+        if (!s->power_on_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        *mseconds = s->power_on_mseconds;
+        return 0;
+}
+
+int sk_disk_smart_get_power_on(SkDisk *d, uint64_t *mseconds) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_power_on_unlocked(d, mseconds);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_get_power_cycle_unlocked(SkDisk *d, uint64_t *count) {
+        const SkSmartSummary *s;
+
+        assert(d);
+        assert(count);
+
+        if (sk_disk_smart_get_summary(d, &s) < 0)
+                return -1;
+
+        if (!s->power_cycle_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        *count = s->power_cycle_count;
+        return 0;
+}
+
+int sk_disk_smart_get_power_cycle(SkDisk *d, uint64_t *count) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_power_cycle_unlocked(d, count);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_smart_get_bad_unlocked(SkDisk *d, uint64_t *sectors) {
+        const SkSmartSummary *s;
+
+        assert(d);
+        assert(sectors);
+
+        if (sk_disk_smart_get_summary(d, &s) < 0)
+                return -1;
+
+        if (!s->reallocated_sector_count_valid && !s->current_pending_sector_valid) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        if (s->reallocated_sector_count_valid && s->current_pending_sector_valid)
+                *sectors = s->reallocated_sector_count + s->current_pending_sector;
+        else if (s->reallocated_sector_count_valid)
+                *sectors = s->reallocated_sector_count;
+        else
+                *sectors = s->current_pending_sector;
+
+        return 0;
+}
+
+int sk_disk_smart_get_bad(SkDisk *d, uint64_t *sectors) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_bad_unlocked(d, sectors);
+        disk_unlock(d);
+
+        return ret;
+}
+
+const char* sk_smart_overall_to_string(SkSmartOverall overall) {
+
+        /* %STRINGPOOLSTART% */
+        const char * const map[] = {
+                [SK_SMART_OVERALL_GOOD] = "GOOD",
+                [SK_SMART_OVERALL_BAD_ATTRIBUTE_IN_THE_PAST] = "BAD_ATTRIBUTE_IN_THE_PAST",
+                [SK_SMART_OVERALL_BAD_SECTOR] = "BAD_SECTOR",
+                [SK_SMART_OVERALL_BAD_ATTRIBUTE_NOW] = "BAD_ATTRIBUTE_NOW",
+                [SK_SMART_OVERALL_BAD_SECTOR_MANY] = "BAD_SECTOR_MANY",
+                [SK_SMART_OVERALL_BAD_STATUS] = "BAD_STATUS",
+        };
+        /* %STRINGPOOLSTOP% */
+
+        if (overall >= _SK_SMART_OVERALL_MAX)
+                return NULL;
+
+        return _P(map[overall]);
+}
+
+static uint64_t u64log2(uint64_t n) {
+        unsigned r;
+
+        if (n <= 1)
+                return 0;
+
+        r = 0;
+        for (;;) {
+                n = n >> 1;
+                if (!n)
+                        return r;
+                r++;
+        }
+}
+
+static int disk_smart_get_overall_unlocked(SkDisk *d, SkSmartOverall *overall) {
+        SkBool good;
+        uint64_t sectors, sector_threshold;
+        const SkSmartSummary *s;
+
+        assert(d);
+        assert(overall);
+
+        /* First, check SMART self-assesment */
+        if (disk_smart_status_cached(d, &good) < 0)
+                return -1;
+
+        if (!good) {
+                *overall = SK_SMART_OVERALL_BAD_STATUS;
+                return 0;
+        }
+
+        /* Second, check if the number of bad sectors is greater than
+         * a certain threshold */
+        if (sk_disk_smart_get_bad(d, &sectors) < 0) {
+                if (errno != ENOENT)
+                        return -1;
+                sectors = 0;
+        } else {
+
+                /* We use log2(n_sectors)*1024 as a threshold here. We
+                 * had to pick something, and this makes a bit of
+                 * sense, or doesn't it? */
+                sector_threshold = u64log2(d->size/512) * 1024;
+
+                if (sectors >= sector_threshold) {
+                        *overall = SK_SMART_OVERALL_BAD_SECTOR_MANY;
+                        return 0;
+                }
+        }
+
+        /* Third, check if any of the SMART attributes is bad */
+        if (sk_disk_smart_get_summary(d, &s) < 0)
+                return -1;
+
+        if (s->bad_attribute_now) {
+                *overall = SK_SMART_OVERALL_BAD_ATTRIBUTE_NOW;
+                return 0;
+        }
+
+        /* Fourth, check if there are any bad sectors at all */
+        if (sectors > 0) {
+                *overall = SK_SMART_OVERALL_BAD_SECTOR;
+                return 0;
+        }
+
+        /* Fifth, check if any of the SMART attributes ever was bad */
+        if (s->bad_attribute_in_the_past) {
+                *overall = SK_SMART_OVERALL_BAD_ATTRIBUTE_IN_THE_PAST;
+                return 0;
+        }
+
+        /* Sixth, there's really nothing to complain about, so give it a pass */
+        *overall = SK_SMART_OVERALL_GOOD;
+        return 0;
+}
+
+int sk_disk_smart_get_overall(SkDisk *d, SkSmartOverall *overall) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_smart_get_overall_unlocked(d, overall);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static char* print_name(char *s, size_t len, uint8_t id, const char *k) {
+
+        if (k)
+                strncpy(s, k, len);
+        else
+                snprintf(s, len, "%u", id);
+
+        s[len-1] = 0;
+
+        return s;
+}
+
+static char *print_value(char *s, size_t len, uint64_t pretty_value, SkSmartAttributeUnit pretty_unit) {
+
+        switch (pretty_unit) {
+                case SK_SMART_ATTRIBUTE_UNIT_MSECONDS:
+
+                        if (pretty_value >= 1000LLU*60LLU*60LLU*24LLU*365LLU)
+                                snprintf(s, len, "%0.1f years", ((double) pretty_value)/(1000.0*60*60*24*365));
+                        else if (pretty_value >= 1000LLU*60LLU*60LLU*24LLU*30LLU)
+                                snprintf(s, len, "%0.1f months", ((double) pretty_value)/(1000.0*60*60*24*30));
+                        else if (pretty_value >= 1000LLU*60LLU*60LLU*24LLU)
+                                snprintf(s, len, "%0.1f days", ((double) pretty_value)/(1000.0*60*60*24));
+                        else if (pretty_value >= 1000LLU*60LLU*60LLU)
+                                snprintf(s, len, "%0.1f h", ((double) pretty_value)/(1000.0*60*60));
+                        else if (pretty_value >= 1000LLU*60LLU)
+                                snprintf(s, len, "%0.1f min", ((double) pretty_value)/(1000.0*60));
+                        else if (pretty_value >= 1000LLU)
+                                snprintf(s, len, "%0.1f s", ((double) pretty_value)/(1000.0));
+                        else
+                                snprintf(s, len, "%llu ms", (unsigned long long) pretty_value);
+
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_MKELVIN:
+                        snprintf(s, len, "%0.1f C", ((double) pretty_value - 273150) / 1000);
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_SECTORS:
+                        snprintf(s, len, "%llu sectors", (unsigned long long) pretty_value);
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_PERCENT:
+                        snprintf(s, len, "%llu%%", (unsigned long long) pretty_value);
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT:
+                        snprintf(s, len, "%0.3f%%", (double) pretty_value);
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_MB:
+                        if (pretty_value >= 1000000LLU)
+                          snprintf(s, len, "%0.3f TB",  (double) pretty_value / 1000000LLU);
+                        else if (pretty_value >= 1000LLU)
+                          snprintf(s, len, "%0.3f GB",  (double) pretty_value / 1000LLU);
+                        else
+                          snprintf(s, len, "%llu MB", (unsigned long long) pretty_value);
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_NONE:
+                        snprintf(s, len, "%llu", (unsigned long long) pretty_value);
+                        break;
+
+                case SK_SMART_ATTRIBUTE_UNIT_UNKNOWN:
+                        snprintf(s, len, "n/a");
+                        break;
+
+                case _SK_SMART_ATTRIBUTE_UNIT_MAX:
+                        assert(FALSE);
+        }
+
+        s[len-1] = 0;
+
+        return s;
+}
+
+#define HIGHLIGHT "\x1B[1m"
+#define ENDHIGHLIGHT "\x1B[0m"
+
+static void disk_dump_attributes(SkDisk *d, const SkSmartAttributeParsedData *a, void* userdata) {
+        char name[32];
+        char pretty[32];
+        char tt[32], tw[32], tc[32];
+        SkBool highlight;
+
+        snprintf(tt, sizeof(tt), "%3u", a->threshold);
+        tt[sizeof(tt)-1] = 0;
+        snprintf(tw, sizeof(tw), "%3u", a->worst_value);
+        tw[sizeof(tw)-1] = 0;
+        snprintf(tc, sizeof(tc), "%3u", a->current_value);
+        tc[sizeof(tc)-1] = 0;
+
+        highlight = a->warn && isatty(1);
+
+        if (highlight)
+                fprintf(stderr, HIGHLIGHT);
+
+        printf("%3u %-27s %-3s   %-3s   %-3s   %-11s 0x%02x%02x%02x%02x%02x%02x %-7s %-7s %-4s %-4s\n",
+               a->id,
+               print_name(name, sizeof(name), a->id, a->name),
+               a->current_value_valid ? tc : "n/a",
+               a->worst_value_valid ? tw : "n/a",
+               a->threshold_valid ? tt : "n/a",
+               print_value(pretty, sizeof(pretty), a->pretty_value, a->pretty_unit),
+               a->raw[0], a->raw[1], a->raw[2], a->raw[3], a->raw[4], a->raw[5],
+               a->prefailure ? "prefail" : "old-age",
+               a->online ? "online" : "offline",
+               a->good_now_valid ? yes_no(a->good_now) : "n/a",
+               a->good_in_the_past_valid ? yes_no(a->good_in_the_past) : "n/a");
+
+        if (highlight)
+                fprintf(stderr, ENDHIGHLIGHT);
+}
+
+static int disk_dump_unlocked(SkDisk *d) {
+        int ret;
+        SkBool awake = FALSE;
+        uint64_t size;
+
+        assert(d);
+
+        printf("Device: %s%s%s\n"
+               "Type: %s\n",
+               d->name ? disk_type_to_prefix_string(d->type) : "",
+               d->name ? ":" : "",
+               d->name ? d->name : "n/a",
+               disk_type_to_human_string(d->type));
+
+        ret = sk_disk_get_size(d, &size);
+        if (ret >= 0)
+                printf("Size: %lu MiB\n", (unsigned long) (d->size/1024/1024));
+        else
+                printf("Size: %s\n", strerror(errno));
+
+        if (d->identify_valid) {
+                const SkIdentifyParsedData *ipd;
+                SkSmartQuirk quirk = 0;
+                unsigned i;
+
+                if ((ret = sk_disk_identify_parse(d, &ipd)) < 0)
+                        return ret;
+
+                printf("Model: [%s]\n"
+                       "Serial: [%s]\n"
+                       "Firmware: [%s]\n"
+                       "SMART Available: %s\n",
+                       ipd->model,
+                       ipd->serial,
+                       ipd->firmware,
+                       yes_no(disk_smart_is_available(d)));
+
+                if ((ret = disk_lookup_quirks(d, &quirk)) < 0)
+                        return ret;
+
+                printf("Quirks:");
+
+                for (i = 0; quirk_name[i]; i++)
+                        if (quirk & (1<<i))
+                                printf(" %s", _P(quirk_name[i]));
+
+                printf("\n");
+        }
+
+        ret = sk_disk_check_sleep_mode(d, &awake);
+        printf("Awake: %s\n",
+               ret >= 0 ? yes_no(awake) : strerror(errno));
+
+        if (disk_smart_is_available(d)) {
+                SkSmartOverall overall;
+                const SkSmartParsedData *spd;
+                SkBool good;
+                char pretty[32];
+                uint64_t value, power_on;
+
+                ret = sk_disk_smart_status(d, &good);
+                printf("%sSMART Disk Health Good: %s%s\n",
+                       ret >= 0 && !good ? HIGHLIGHT : "",
+                       ret >= 0 ? yes_no(good) : strerror(errno),
+                       ret >= 0 && !good ? ENDHIGHLIGHT : "");
+                if ((ret = sk_disk_smart_read_data(d)) < 0)
+                        return ret;
+
+                if ((ret = sk_disk_smart_parse(d, &spd)) < 0)
+                        return ret;
+
+                printf("Off-line Data Collection Status: [%s]\n"
+                       "Total Time To Complete Off-Line Data Collection: %u s\n"
+                       "Self-Test Execution Status: [%s]\n"
+                       "Percent Self-Test Remaining: %u%%\n"
+                       "Conveyance Self-Test Available: %s\n"
+                       "Short/Extended Self-Test Available: %s\n"
+                       "Start Self-Test Available: %s\n"
+                       "Abort Self-Test Available: %s\n"
+                       "Short Self-Test Polling Time: %u min\n"
+                       "Extended Self-Test Polling Time: %u min\n"
+                       "Conveyance Self-Test Polling Time: %u min\n",
+                       sk_smart_offline_data_collection_status_to_string(spd->offline_data_collection_status),
+                       spd->total_offline_data_collection_seconds,
+                       sk_smart_self_test_execution_status_to_string(spd->self_test_execution_status),
+                       spd->self_test_execution_percent_remaining,
+                       yes_no(spd->conveyance_test_available),
+                       yes_no(spd->short_and_extended_test_available),
+                       yes_no(spd->start_test_available),
+                       yes_no(spd->abort_test_available),
+                       spd->short_test_polling_minutes,
+                       spd->extended_test_polling_minutes,
+                       spd->conveyance_test_polling_minutes);
+
+                if (sk_disk_smart_get_bad(d, &value) < 0)
+                        printf("Bad Sectors: %s\n", strerror(errno));
+                else
+                        printf("%sBad Sectors: %s%s\n",
+                               value > 0 ? HIGHLIGHT : "",
+                               print_value(pretty, sizeof(pretty), value, SK_SMART_ATTRIBUTE_UNIT_SECTORS),
+                               value > 0 ? ENDHIGHLIGHT : "");
+
+                if (sk_disk_smart_get_power_on(d, &power_on) < 0) {
+                        printf("Powered On: %s\n", strerror(errno));
+                        power_on = 0;
+                } else
+                        printf("Powered On: %s\n", print_value(pretty, sizeof(pretty), power_on, SK_SMART_ATTRIBUTE_UNIT_MSECONDS));
+
+                if (sk_disk_smart_get_power_cycle(d, &value) < 0)
+                        printf("Power Cycles: %s\n", strerror(errno));
+                else {
+                        printf("Power Cycles: %llu\n", (unsigned long long) value);
+
+                        if (value > 0 && power_on > 0)
+                                printf("Average Powered On Per Power Cycle: %s\n", print_value(pretty, sizeof(pretty), power_on/value, SK_SMART_ATTRIBUTE_UNIT_MSECONDS));
+                }
+
+                if (sk_disk_smart_get_temperature(d, &value) < 0)
+                        printf("Temperature: %s\n", strerror(errno));
+                else
+                        printf("Temperature: %s\n", print_value(pretty, sizeof(pretty), value, SK_SMART_ATTRIBUTE_UNIT_MKELVIN));
+
+                printf("Attribute Parsing Verification: %s\n",
+                       d->attribute_verification_bad ? "Bad" : "Good");
+
+                if (sk_disk_smart_get_overall(d, &overall) < 0)
+                        printf("Overall Status: %s\n", strerror(errno));
+                else
+                        printf("%sOverall Status: %s%s\n",
+                               overall != SK_SMART_OVERALL_GOOD ? HIGHLIGHT : "",
+                               sk_smart_overall_to_string(overall),
+                               overall != SK_SMART_OVERALL_GOOD ? ENDHIGHLIGHT : "");
 
-                                break;
+                printf("%3s %-27s %5s %5s %5s %-11s %-14s %-7s %-7s %-4s %-4s\n",
+                       "ID#",
+                       "Name",
+                       "Value",
+                       "Worst",
+                       "Thres",
+                       "Pretty",
+                       "Raw",
+                       "Type",
+                       "Updates",
+                       "Good",
+                       "Good/Past");
 
-                        case 190:
-                                if (quirk & SK_SMART_QUIRK_190_UNKNOWN)
-                                        return NULL;
+                if ((ret = sk_disk_smart_parse_attributes(d, disk_dump_attributes, NULL)) < 0)
+                        return ret;
+        } else
+                printf("ATA SMART not supported.\n");
 
-                                break;
+        return 0;
+}
 
-                        case 192:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_192_EMERGENCYRETRACTCYCLECT) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "emergency-retract-cycle-count", SK_SMART_ATTRIBUTE_UNIT_NONE, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+int sk_disk_dump(SkDisk *d) {
+        int ret;
 
-                                break;
+        disk_lock(d);
+        ret = disk_dump_unlocked(d);
+        disk_unlock(d);
 
-                        case 194:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_194_10XCELSIUS) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "temperature-centi-celsius", SK_SMART_ATTRIBUTE_UNIT_MKELVIN, verify_temperature
-                                        };
-                                        return &a;
-                                } else if (quirk & SK_SMART_QUIRK_194_UNKNOWN)
-                                        return NULL;
-                                /* %STRINGPOOLSTOP% */
+        return ret;
+}
 
-                                break;
+int sk_disk_get_size(SkDisk *d, uint64_t *bytes) {
+        assert(d);
+        assert(bytes);
 
-                        case 197:
-                                if (quirk & SK_SMART_QUIRK_197_UNKNOWN)
-                                        return NULL;
+        if (d->size == (uint64_t) -1) {
+                errno = ENODATA;
+                return -1;
+        }
 
-                                break;
+        *bytes = d->size;
+        return 0;
+}
 
-                        case 198:
-                                if (quirk & SK_SMART_QUIRK_198_UNKNOWN)
-                                        return NULL;
+static int disk_find_type(SkDisk *d, dev_t devnum) {
+        struct udev *udev;
+        struct udev_device *dev = NULL, *usb;
+        int r = -1;
+        const char *a;
 
-                                break;
+        assert(d);
 
-                        case 200:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_200_WRITEERRORCOUNT) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "write-error-count", SK_SMART_ATTRIBUTE_UNIT_NONE, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+        if (!(udev = udev_new())) {
+                errno = ENXIO;
+                goto finish;
+        }
 
-                                break;
+        if (!(dev = udev_device_new_from_devnum(udev, 'b', devnum))) {
+                errno = ENODEV;
+                goto finish;
+        }
 
-                        case 201:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_201_DETECTEDTACOUNT) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "detected-ta-count", SK_SMART_ATTRIBUTE_UNIT_NONE, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+        if ((a = udev_device_get_property_value(dev, "ID_ATA_SMART_ACCESS"))) {
+                unsigned u;
 
-                                break;
+                for (u = 0; u < _SK_DISK_TYPE_MAX; u++) {
+                        const char *t;
 
-                        case 225:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_225_TOTALLBASWRITTEN) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "total-lbas-written", SK_SMART_ATTRIBUTE_UNIT_MB, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+                        if (!(t = disk_type_to_prefix_string(u)))
+                                continue;
 
-                                break;
+                        if (!strcmp(a, t)) {
+                                d->type = u;
+                                r = 0;
+                                goto finish;
+                        }
+                }
+
+                d->type = SK_DISK_TYPE_NONE;
+                r = 0;
+                goto finish;
+        }
+
+        if ((usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device"))) {
+                const char *product, *vendor;
+                uint32_t pid, vid;
+
+                if (!(product = udev_device_get_sysattr_value(usb, "idProduct")) ||
+                    sscanf(product, "%04x", &pid) != 1) {
+                        errno = ENODEV;
+                        goto finish;
+                }
+
+                if (!(vendor = udev_device_get_sysattr_value(usb, "idVendor")) ||
+                    sscanf(vendor, "%04x", &vid) != 1) {
+                        errno = ENODEV;
+                        goto finish;
+                }
+
+                if ((vid == 0x0928 && pid == 0x0000))
+                        /* This Oxford Semiconductor bridge seems to
+                         * choke on SAT commands. Let's explicitly
+                         * black list it here.
+                         *
+                         * http://bugs.freedesktop.org/show_bug.cgi?id=24951 */
+                        d->type = SK_DISK_TYPE_NONE;
+                else if ((vid == 0x152d && pid == 0x2329) ||
+                         (vid == 0x152d && pid == 0x2338) ||
+                         (vid == 0x152d && pid == 0x2339))
+                        /* Some JMicron bridges seem to choke on SMART
+                         * commands, so let's explicitly black list
+                         * them here.
+                         *
+                         * https://bugzilla.redhat.com/show_bug.cgi?id=515881
+                         *
+                         * At least some of the JMicron bridges with
+                         * these vids/pids choke on the jmicron access
+                         * mode. To make sure we don't break things
+                         * for people we now disable this by
+                         * default. */
+                        d->type = SK_DISK_TYPE_NONE;
+                else if ((vid == 0x152d && pid == 0x2336))
+                        /* This JMicron bridge seems to always work
+                         * with SMART commands send with the jmicron
+                         * access mode. */
+                        d->type = SK_DISK_TYPE_JMICRON;
+                else if ((vid == 0x0c0b && pid == 0xb159) ||
+                    (vid == 0x04fc && pid == 0x0c25) ||
+                    (vid == 0x04fc && pid == 0x0c15))
+                        d->type = SK_DISK_TYPE_SUNPLUS;
+                else
+                        d->type = SK_DISK_TYPE_ATA_PASSTHROUGH_12;
+
+        } else if (udev_device_get_parent_with_subsystem_devtype(dev, "ide", NULL))
+                d->type = SK_DISK_TYPE_LINUX_IDE;
+        else if (udev_device_get_parent_with_subsystem_devtype(dev, "scsi", NULL))
+                d->type = SK_DISK_TYPE_ATA_PASSTHROUGH_16;
+        else
+                d->type = SK_DISK_TYPE_AUTO;
+
+        r = 0;
+
+finish:
+        if (dev)
+                udev_device_unref(dev);
+
+        if (udev)
+                udev_unref(udev);
+
+        return r;
+}
+
+static int init_smart(SkDisk *d) {
+        /* We don't do the SMART initialization right-away, since some
+         * drivers spin up when we do that */
+
+        int ret;
+
+        if (d->smart_initialized)
+                return 0;
+
+        d->smart_initialized = TRUE;
+
+        /* Check if driver can do SMART, and enable if necessary */
+        if (!disk_smart_is_available(d))
+                return 0;
+
+        if (!disk_smart_is_enabled(d)) {
+                if ((ret = disk_smart_enable(d, TRUE)) < 0)
+                        goto fail;
+
+                if ((ret = disk_identify_device(d)) < 0)
+                        goto fail;
+
+                if (!disk_smart_is_enabled(d)) {
+                        errno = EIO;
+                        ret = -1;
+                        goto fail;
+                }
+        }
+
+        disk_smart_read_thresholds(d);
+        ret = 0;
+
+fail:
+        return ret;
+}
+
+int sk_disk_open_with_timeout(const char *name, uint64_t usec, SkDisk **_d) {
+        SkDisk *d;
+        int ret = -1;
+        struct stat st;
+
+        assert(_d);
+
+        if (!(d = calloc(1, sizeof(SkDisk)))) {
+                errno = ENOMEM;
+                goto fail;
+        }
+
+        d->fd = -1;
+        d->sg_fd = -1;
+        d->size = (uint64_t) -1;
+        d->generation = 1;
+
+        if (usec > 0)
+                d->deadline_usec = now_usec() + usec;
+
+        if (!name)
+                d->type = SK_DISK_TYPE_BLOB;
+        else {
+                const char *dn;
+
+                d->type = SK_DISK_TYPE_AUTO;
+
+                if (!(dn = disk_type_from_string(name, &d->type)))
+                        dn = name;
+
+                if (!(d->name = strdup(dn))) {
+                        errno = ENOMEM;
+                        goto fail;
+                }
 
-                        case 226:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_226_TIMEWORKLOADMEDIAWEAR) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "timed-workload-media-wear", SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+                if ((d->fd = open(d->name,
+                                  O_RDONLY|O_NOCTTY|O_NONBLOCK
+#ifdef O_CLOEXEC
+                                  |O_CLOEXEC
+#endif
 
-                                break;
+                     )) < 0) {
+                        ret = d->fd;
+                        goto fail;
+                }
 
-                        case 227:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_227_TIMEWORKLOADHOSTREADS) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "timed-workload-host-reads", SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+                if ((ret = fstat(d->fd, &st)) < 0)
+                        goto fail;
 
-                                break;
+                if (!S_ISBLK(st.st_mode)) {
+                        errno = ENODEV;
+                        ret = -1;
+                        goto fail;
+                }
 
-                        case 228:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_228_WORKLOADTIMER) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "workload-timer", SK_SMART_ATTRIBUTE_UNIT_MSECONDS, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
+                /* So, it's a block device. Let's make sure the ioctls work */
+                if ((ret = ioctl(d->fd, BLKGETSIZE64, &d->size)) < 0)
+                        goto fail;
 
-                                break;
+                if (d->size <= 0 || d->size == (uint64_t) -1) {
+                        errno = EIO;
+                        ret = -1;
+                        goto fail;
+                }
 
-                        case 232:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_232_AVAILABLERESERVEDSPACE) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "available-reserved-space", SK_SMART_ATTRIBUTE_UNIT_PERCENT, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
-                                break;
+                /* OK, it's a real block device with a size. Now let's find the suitable API */
+                if (d->type == SK_DISK_TYPE_AUTO)
+                        if ((ret = disk_find_type(d, st.st_rdev)) < 0)
+                                goto fail;
 
-                        case 233:
-                                /* %STRINGPOOLSTART% */
-                                if (quirk & SK_SMART_QUIRK_233_MEDIAWEAROUTINDICATOR) {
-                                        static const SkSmartAttributeInfo a = {
-                                                "media-wearout-indicator", SK_SMART_ATTRIBUTE_UNIT_PERCENT, NULL
-                                        };
-                                        return &a;
-                                }
-                                /* %STRINGPOOLSTOP% */
-                                break;
+                if (d->type == SK_DISK_TYPE_AUTO) {
+                        /* We have no clue, so let's autotest for a working API */
+                        for (d->type = 0; d->type < _SK_DISK_TYPE_TEST_MAX; d->type++)
+                                if (disk_identify_device(d) >= 0 || disk_deadline_passed(d))
+                                        break;
+                        if (d->type >= _SK_DISK_TYPE_TEST_MAX)
+                                d->type = SK_DISK_TYPE_NONE;
+                } else
+                        disk_identify_device(d);
 
+                if (!d->identify_valid && disk_deadline_passed(d)) {
+                        errno = ETIMEDOUT;
+                        ret = -1;
+                        goto fail;
                 }
         }
 
-        /* These are the simple cases */
-        if (attribute_info[id].name)
-                return &attribute_info[id];
+        /* The deadline only covers the open itself */
+        d->deadline_usec = 0;
 
-        return NULL;
-}
+        *_d = d;
 
-int sk_disk_smart_parse(SkDisk *d, const SkSmartParsedData **spd) {
+        return 0;
 
-        if (!d->smart_data_valid) {
-                errno = ENOENT;
-                return -1;
-        }
+fail:
 
-        switch (d->smart_data[362]) {
-                case 0x00:
-                case 0x80:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_NEVER;
-                        break;
+        if (d)
+                sk_disk_free(d);
 
-                case 0x02:
-                case 0x82:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUCCESS;
-                        break;
+        return ret;
+}
 
-                case 0x03:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_INPROGRESS;
-                        break;
+int sk_disk_open(const char *name, SkDisk **d) {
+        return sk_disk_open_with_timeout(name, 0, d);
+}
 
-                case 0x04:
-                case 0x84:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_SUSPENDED;
-                        break;
+static int disk_refresh_unlocked(SkDisk *d, unsigned flags) {
+        SkBool b, initialized;
 
-                case 0x05:
-                case 0x85:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_ABORTED;
-                        break;
+        if (flags & ~(SK_DISK_REFRESH_SMART_DATA|SK_DISK_REFRESH_STATUS|SK_DISK_REFRESH_IDENTIFY|SK_DISK_REFRESH_THRESHOLDS)) {
+                errno = EINVAL;
+                return -1;
+        }
 
-                case 0x06:
-                case 0x86:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_FATAL;
-                        break;
+        /* Nothing to re-read */
+        if (d->type == SK_DISK_TYPE_BLOB)
+                return 0;
 
-                default:
-                        d->smart_parsed_data.offline_data_collection_status = SK_SMART_OFFLINE_DATA_COLLECTION_STATUS_UNKNOWN;
-                        break;
-        }
+        if (flags & SK_DISK_REFRESH_IDENTIFY)
+                if (disk_identify_device(d) < 0)
+                        return -1;
 
-        d->smart_parsed_data.self_test_execution_percent_remaining = 10*(d->smart_data[363] & 0xF);
-        d->smart_parsed_data.self_test_execution_status = (d->smart_data[363] >> 4) & 0xF;
+        if (flags & SK_DISK_REFRESH_THRESHOLDS) {
+                initialized = d->smart_initialized;
 
-        d->smart_parsed_data.total_offline_data_collection_seconds = (uint16_t) d->smart_data[364] | ((uint16_t) d->smart_data[365] << 8);
+                if (init_smart(d) < 0)
+                        return -1;
 
-        d->smart_parsed_data.conveyance_test_available = disk_smart_is_conveyance_test_available(d);
-        d->smart_parsed_data.short_and_extended_test_available = disk_smart_is_short_and_extended_test_available(d);
-        d->smart_parsed_data.start_test_available = disk_smart_is_start_test_available(d);
-        d->smart_parsed_data.abort_test_available = disk_smart_is_abort_test_available(d);
+                /* On first use init_smart() just read them, so only
+                 * ask again if that failed */
+                if ((initialized || !d->smart_thresholds_valid) &&
+                    disk_smart_read_thresholds(d) < 0)
+                        return -1;
+        }
 
-        d->smart_parsed_data.short_test_polling_minutes = d->smart_data[372];
-        d->smart_parsed_data.extended_test_polling_minutes = d->smart_data[373] != 0xFF ? d->smart_data[373] : ((uint16_t) d->smart_data[376] << 8 | (uint16_t) d->smart_data[375]);
-        d->smart_parsed_data.conveyance_test_polling_minutes = d->smart_data[374];
+        if (flags & SK_DISK_REFRESH_SMART_DATA)
+                if (sk_disk_smart_read_data(d) < 0)
+                        return -1;
 
-        *spd = &d->smart_parsed_data;
+        /* Last, so that the status counts as being as recent as the
+         * data */
+        if (flags & SK_DISK_REFRESH_STATUS)
+                if (sk_disk_smart_status(d, &b) < 0)
+                        return -1;
 
         return 0;
 }
 
-static void find_threshold(SkDisk *d, SkSmartAttributeParsedData *a) {
-        uint8_t *p;
-        unsigned n;
+int sk_disk_refresh(SkDisk *d, unsigned flags) {
+        int ret;
 
-        if (!d->smart_thresholds_valid)
-                goto fail;
+        assert(d);
 
-        for (n = 0, p = d->smart_thresholds+2; n < 30; n++, p+=12)
-                if (p[0] == a->id)
-                        break;
+        disk_lock(d);
+        ret = disk_refresh_unlocked(d, flags);
+        disk_unlock(d);
 
-        if (n >= 30)
-                goto fail;
+        return ret;
+}
 
-        a->threshold = p[1];
-        a->threshold_valid = p[1] != 0xFE;
+int sk_disk_set_refresh_policy(SkDisk *d, uint64_t min_interval_usec, unsigned max_commands_per_hour) {
+        assert(d);
 
-        a->good_now_valid = FALSE;
-        a->good_now = TRUE;
-        a->good_in_the_past_valid = FALSE;
-        a->good_in_the_past = TRUE;
+        disk_lock(d);
 
-        /* Always-Fail and Always-Passing thresholds are not relevant
-         * for our assessment. */
-        if (p[1] >= 1 && p[1] <= 0xFD) {
+        d->refresh_min_interval_usec = min_interval_usec;
+        d->refresh_max_per_hour = max_commands_per_hour;
+        d->refresh_tat = 0;
 
-                if (a->worst_value_valid) {
-                        a->good_in_the_past = a->good_in_the_past && (a->worst_value > a->threshold);
-                        a->good_in_the_past_valid = TRUE;
-                }
+        disk_unlock(d);
 
-                if (a->current_value_valid) {
-                        a->good_now = a->good_now && (a->current_value > a->threshold);
-                        a->good_now_valid = TRUE;
-                }
-        }
+        return 0;
+}
 
-        a->warn =
-                (a->good_now_valid && !a->good_now) ||
-                (a->good_in_the_past_valid && !a->good_in_the_past);
+int sk_disk_set_timeout(SkDisk *d, SkCommandClass c, unsigned msec) {
+        assert(d);
 
-        return;
+        if (c >= _SK_COMMAND_CLASS_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
 
-fail:
-        a->threshold_valid = FALSE;
-        a->good_now_valid = FALSE;
-        a->good_in_the_past_valid = FALSE;
-        a->warn = FALSE;
+        disk_lock(d);
+        d->timeout[c] = msec;
+        disk_unlock(d);
+
+        return 0;
 }
 
-int sk_disk_smart_parse_attributes(SkDisk *d, SkSmartAttributeParseCallback cb, void* userdata) {
-        uint8_t *p;
-        unsigned n;
+int sk_disk_set_circuit_breaker(SkDisk *d, unsigned failures, unsigned base_msec, unsigned max_msec) {
+        assert(d);
 
-        if (!d->smart_data_valid) {
-                errno = ENOENT;
+        if (failures > 0 && (base_msec <= 0 || max_msec < base_msec)) {
+                errno = EINVAL;
                 return -1;
         }
 
-        for (n = 0, p = d->smart_data + 2; n < 30; n++, p+=12) {
-                SkSmartAttributeParsedData a;
-                const SkSmartAttributeInfo *i;
-                char *an = NULL;
-
-                if (p[0] == 0)
-                        continue;
-
-                memset(&a, 0, sizeof(a));
-                a.id = p[0];
-                a.current_value = p[3];
-                a.current_value_valid = p[3] >= 1 && p[3] <= 0xFD;
-                a.worst_value = p[4];
-                a.worst_value_valid = p[4] >= 1 && p[4] <= 0xFD;
+        disk_lock(d);
 
-                a.flags = ((uint16_t) p[2] << 8) | p[1];
-                a.prefailure = !!(p[1] & 1);
-                a.online = !!(p[1] & 2);
+        d->breaker_threshold = failures;
+        d->breaker_base = base_msec;
+        d->breaker_max = max_msec;
+        d->breaker_failures = 0;
+        d->breaker_backoff = 0;
+        d->breaker_probing = FALSE;
 
-                memcpy(a.raw, p+5, 6);
+        disk_unlock(d);
 
-                if ((i = lookup_attribute(d, p[0]))) {
-                        a.name = _P(i->name);
-                        a.pretty_unit = i->unit;
-                } else {
-                        if (asprintf(&an, "attribute-%u", a.id) < 0) {
-                                errno = ENOMEM;
-                                return -1;
-                        }
+        return 0;
+}
 
-                        a.name = an;
-                        a.pretty_unit = SK_SMART_ATTRIBUTE_UNIT_UNKNOWN;
-                }
+int sk_disk_set_deadline(SkDisk *d, uint64_t usec) {
+        assert(d);
 
-                make_pretty(&a);
+        disk_lock(d);
+        d->deadline_usec = usec > 0 ? now_usec() + usec : 0;
+        disk_unlock(d);
 
-                find_threshold(d, &a);
+        return 0;
+}
 
-                if (i && i->verify)
-                        i->verify(d, &a);
+static int disk_get_age(SkDisk *d, uint64_t then, uint64_t *usec) {
 
-                cb(d, &a, userdata);
-                free(an);
+        if (then <= 0) {
+                errno = ENODATA;
+                return -1;
         }
 
+        *usec = now_usec() - then;
         return 0;
 }
 
-static const char *yes_no(SkBool b) {
-        return  b ? "yes" : "no";
+int sk_disk_smart_get_data_age(SkDisk *d, uint64_t *usec) {
+        int ret;
+
+        assert(d);
+        assert(usec);
+
+        disk_lock(d);
+        ret = disk_get_age(d, d->smart_data_valid ? d->smart_data_usec : 0, usec);
+        disk_unlock(d);
+
+        return ret;
 }
 
-const char* sk_smart_attribute_unit_to_string(SkSmartAttributeUnit unit) {
+int sk_disk_smart_get_status_age(SkDisk *d, uint64_t *usec) {
+        int ret;
 
-        /* %STRINGPOOLSTART% */
-        const char * const map[] = {
-                [SK_SMART_ATTRIBUTE_UNIT_UNKNOWN] = NULL,
-                [SK_SMART_ATTRIBUTE_UNIT_NONE] = "",
-                [SK_SMART_ATTRIBUTE_UNIT_MSECONDS] = "ms",
-                [SK_SMART_ATTRIBUTE_UNIT_SECTORS] = "sectors",
-                [SK_SMART_ATTRIBUTE_UNIT_MKELVIN] = "mK",
-                [SK_SMART_ATTRIBUTE_UNIT_PERCENT] = "%",
-                [SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT] = "%",
-                [SK_SMART_ATTRIBUTE_UNIT_MB] = "MB"
-        };
-        /* %STRINGPOOLSTOP% */
+        assert(d);
+        assert(usec);
+
+        disk_lock(d);
+        ret = disk_get_age(d, d->status_valid ? d->status_usec : 0, usec);
+        disk_unlock(d);
+
+        return ret;
+}
+
+int sk_disk_set_thread_safe(SkDisk *d, SkBool b) {
+        pthread_mutexattr_t attr;
+        int r;
+
+        assert(d);
 
-        if (unit >= _SK_SMART_ATTRIBUTE_UNIT_MAX)
-                return NULL;
+        if (!d->locks_initialized) {
 
-        return _P(map[unit]);
-}
+                if (!b)
+                        return 0;
 
-struct attr_helper {
-        uint64_t *value;
-        SkBool found;
-};
 
-static void temperature_cb(SkDisk *d, const SkSmartAttributeParsedData *a, struct attr_helper *ah) {
+                /* The public functions call each other */
+                if ((r = pthread_mutexattr_init(&attr)) != 0) {
+                        errno = r;
+                        return -1;
+                }
 
-        if (a->pretty_unit != SK_SMART_ATTRIBUTE_UNIT_MKELVIN)
-                return;
+                if ((r = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE)) != 0 ||
+                    (r = pthread_mutex_init(&d->lock, &attr)) != 0) {
+                        pthread_mutexattr_destroy(&attr);
+                        errno = r;
+                        return -1;
+                }
 
-        if (!strcmp(a->name, "temperature-centi-celsius") ||
-            !strcmp(a->name, "temperature-celsius") ||
-            !strcmp(a->name, "temperature-celsius-2") ||
-            !strcmp(a->name, "airflow-temperature-celsius")) {
+                pthread_mutexattr_destroy(&attr);
 
-                if (!ah->found || a->pretty_value > *ah->value)
-                        *ah->value = a->pretty_value;
+                if ((r = pthread_mutex_init(&d->snapshot_lock, NULL)) != 0) {
+                        pthread_mutex_destroy(&d->lock);
+                        errno = r;
+                        return -1;
+                }
 
-                ah->found = TRUE;
+                d->locks_initialized = TRUE;
         }
-}
-
-int sk_disk_smart_get_temperature(SkDisk *d, uint64_t *kelvin) {
-        struct attr_helper ah;
 
-        assert(d);
-        assert(kelvin);
+        disk_lock(d);
 
-        ah.found = FALSE;
-        ah.value = kelvin;
+        pthread_mutex_lock(&d->snapshot_lock);
+        d->thread_safe = !!b;
+        pthread_mutex_unlock(&d->snapshot_lock);
 
-        if (sk_disk_smart_parse_attributes(d, (SkSmartAttributeParseCallback) temperature_cb, &ah) < 0)
-                return -1;
+        if (b && d->identify_valid)
+                disk_publish_snapshot(d);
 
-        if (!ah.found) {
-                errno = ENOENT;
-                return -1;
-        }
+        disk_unlock(d);
 
         return 0;
 }
 
-static void power_on_cb(SkDisk *d, const SkSmartAttributeParsedData *a, struct attr_helper *ah) {
+void sk_disk_free(SkDisk *d) {
+        assert(d);
 
-        if (a->pretty_unit != SK_SMART_ATTRIBUTE_UNIT_MSECONDS)
-                return;
+        if (d->fd >= 0)
+                close(d->fd);
 
-        if (!strcmp(a->name, "power-on-minutes") ||
-            !strcmp(a->name, "power-on-seconds") ||
-            !strcmp(a->name, "power-on-seconds-2") ||
-            !strcmp(a->name, "power-on-half-minutes") ||
-            !strcmp(a->name, "power-on-hours")) {
+        if (d->sg_fd >= 0)
+                close(d->sg_fd);
 
-                if (!ah->found || a->pretty_value > *ah->value)
-                        *ah->value = a->pretty_value;
+        sk_snapshot_unref(d->snapshot);
 
-                ah->found = TRUE;
+        if (d->locks_initialized) {
+                pthread_mutex_destroy(&d->lock);
+                pthread_mutex_destroy(&d->snapshot_lock);
         }
+
+        free(d->name);
+        free(d);
 }
 
-int sk_disk_smart_get_power_on(SkDisk *d, uint64_t *mseconds) {
-        struct attr_helper ah;
+static int disk_get_blob_unlocked(SkDisk *d, const void **blob, size_t *rsize) {
+        size_t size;
+        SkBool good, have_good = FALSE;
+        uint32_t *p;
 
         assert(d);
-        assert(mseconds);
+        assert(blob);
+        assert(rsize);
 
-        ah.found = FALSE;
-        ah.value = mseconds;
+        size =
+                (d->identify_valid ? 8 + sizeof(d->identify) : 0) +
+                (d->smart_data_valid ? 8 + sizeof(d->smart_data) : 0) +
+                (d->smart_thresholds_valid ? 8 + sizeof(d->smart_thresholds) : 0);
 
-        if (sk_disk_smart_parse_attributes(d, (SkSmartAttributeParseCallback) power_on_cb, &ah) < 0)
-                return -1;
+        if (disk_smart_status_cached(d, &good) >= 0) {
+                size += 12;
+                have_good = TRUE;
+        }
 
-        if (!ah.found) {
-                errno = ENOENT;
+        if (size <= 0) {
+                errno = ENODATA;
                 return -1;
         }
 
-        return 0;
-}
+        assert(size <= sizeof(d->blob));
 
-static void power_cycle_cb(SkDisk *d, const SkSmartAttributeParsedData *a, struct attr_helper *ah) {
-
-        if (a->pretty_unit != SK_SMART_ATTRIBUTE_UNIT_NONE)
-                return;
+        p = d->blob;
 
-        if (!strcmp(a->name, "power-cycle-count")) {
+        /* These memory accesses are only OK as long as all our
+         * objects are sensibly aligned, which they are... */
 
-                if (!ah->found || a->pretty_value > *ah->value)
-                        *ah->value = a->pretty_value;
+        if (d->identify_valid) {
+                p[0] = SK_BLOB_TAG_IDENTIFY;
+                p[1] = htonl(sizeof(d->identify));
+                p += 2;
 
-                ah->found = TRUE;
+                memcpy(p, d->identify, sizeof(d->identify));
+                p = (uint32_t*) ((uint8_t*) p + sizeof(d->identify));
         }
-}
 
-int sk_disk_smart_get_power_cycle(SkDisk *d, uint64_t *count) {
-        struct attr_helper ah;
+        if (have_good) {
+                p[0] = SK_BLOB_TAG_SMART_STATUS;
+                p[1] = htonl(4);
+                p[2] = htonl(!!good);
+                p += 3;
+        }
 
-        assert(d);
-        assert(count);
+        if (d->smart_data_valid) {
+                p[0] = SK_BLOB_TAG_SMART_DATA;
+                p[1] = htonl(sizeof(d->smart_data));
+                p += 2;
 
-        ah.found = FALSE;
-        ah.value = count;
+                memcpy(p, d->smart_data, sizeof(d->smart_data));
+                p = (uint32_t*) ((uint8_t*) p + sizeof(d->smart_data));
+        }
 
-        if (sk_disk_smart_parse_attributes(d, (SkSmartAttributeParseCallback) power_cycle_cb, &ah) < 0)
-                return -1;
+        if (d->smart_thresholds_valid) {
+                p[0] = SK_BLOB_TAG_SMART_THRESHOLDS;
+                p[1] = htonl(sizeof(d->smart_thresholds));
+                p += 2;
 
-        if (!ah.found) {
-                errno = ENOENT;
-                return -1;
+                memcpy(p, d->smart_thresholds, sizeof(d->smart_thresholds));
+                p = (uint32_t*) ((uint8_t*) p + sizeof(d->smart_thresholds));
         }
 
+        assert((size_t) ((uint8_t*) p - (uint8_t*) d->blob) == size);
+
+        *blob = d->blob;
+        *rsize = size;
+
         return 0;
 }
 
-static void fill_cache_cb(SkDisk *d, const SkSmartAttributeParsedData *a, void* userdata) {
+static int disk_get_page_unlocked(SkDisk *d, SkDiskPage page, const void **data, SkBool *valid, unsigned *generation) {
 
-        if (a->prefailure) {
-                if (a->good_now_valid && !a->good_now)
-                    d->bad_attribute_now = TRUE;
+        assert(d);
+        assert(data);
 
-                if (a->good_in_the_past_valid && !a->good_in_the_past)
-                    d->bad_attribute_in_the_past = TRUE;
-        }
+        switch (page) {
 
-        if (a->pretty_unit != SK_SMART_ATTRIBUTE_UNIT_SECTORS)
-                return;
+                case SK_DISK_PAGE_IDENTIFY:
+                        *data = d->identify;
+                        if (valid)
+                                *valid = d->identify_valid;
+                        break;
 
-        if (!strcmp(a->name, "reallocated-sector-count")) {
-                if (a->pretty_value > d->reallocated_sector_count)
-                        d->reallocated_sector_count = a->pretty_value;
-                d->reallocated_sector_count_found = TRUE;
-        }
+                case SK_DISK_PAGE_SMART_DATA:
+                        *data = d->smart_data;
+                        if (valid)
+                                *valid = d->smart_data_valid;
+                        break;
+
+                case SK_DISK_PAGE_SMART_THRESHOLDS:
+                        *data = d->smart_thresholds;
+                        if (valid)
+                                *valid = d->smart_thresholds_valid;
+                        break;
 
-        if (!strcmp(a->name, "current-pending-sector")) {
-                if (a->pretty_value > d->current_pending_sector)
-                        d->current_pending_sector = a->pretty_value;
-                d->current_pending_sector_found = TRUE;
+                default:
+                        errno = EINVAL;
+                        return -1;
         }
+
+        if (generation)
+                *generation = d->generation;
+
+        return 0;
 }
 
-static int fill_cache(SkDisk *d) {
-        if (d->attribute_cache_valid)
-                return 0;
+int sk_disk_get_page(SkDisk *d, SkDiskPage page, const void **data, SkBool *valid, unsigned *generation) {
+        int ret;
 
-        if (sk_disk_smart_parse_attributes(d, (SkSmartAttributeParseCallback) fill_cache_cb, NULL) >= 0) {
-                d->attribute_cache_valid = TRUE;
-                return 0;
-        } else
-                return -1;
+        disk_lock(d);
+        ret = disk_get_page_unlocked(d, page, data, valid, generation);
+        disk_unlock(d);
+
+        return ret;
 }
 
-int sk_disk_smart_get_bad(SkDisk *d, uint64_t *sectors) {
+int sk_disk_get_blob(SkDisk *d, const void **blob, size_t *rsize) {
+        int ret;
+
+        disk_lock(d);
+        ret = disk_get_blob_unlocked(d, blob, rsize);
+        disk_unlock(d);
+
+        return ret;
+}
+
+static int disk_set_blob_unlocked(SkDisk *d, const void *blob, size_t size) {
+        const uint32_t *p;
+        size_t left;
+        SkBool idv = FALSE, sdv = FALSE, stv = FALSE, bssv = FALSE;
+
         assert(d);
-        assert(sectors);
+        assert(blob);
 
-        if (fill_cache (d) < 0)
+        if (d->type != SK_DISK_TYPE_BLOB) {
+                errno = ENODEV;
                 return -1;
+        }
 
-        if (!d->reallocated_sector_count_found && !d->current_pending_sector_found) {
-                errno = ENOENT;
+        if (size <= 0) {
+                errno = EINVAL;
                 return -1;
         }
 
-        if (d->reallocated_sector_count_found && d->current_pending_sector_found)
-                *sectors = d->reallocated_sector_count + d->current_pending_sector;
-        else if (d->reallocated_sector_count_found)
-                *sectors = d->reallocated_sector_count;
-        else
-                *sectors = d->current_pending_sector;
+        /* First run, verify if everything makes sense */
+        p = blob;
+        left = size;
+        while (left > 0) {
+                uint32_t tag, tsize;
 
-        return 0;
-}
+                if (left < 8) {
+                        errno = EINVAL;
+                        return -1;
+                }
 
-const char* sk_smart_overall_to_string(SkSmartOverall overall) {
+                memcpy(&tag, p, 4);
+                memcpy(&tsize, p+1, 4);
+                p += 2;
+                left -= 8;
 
-        /* %STRINGPOOLSTART% */
-        const char * const map[] = {
-                [SK_SMART_OVERALL_GOOD] = "GOOD",
-                [SK_SMART_OVERALL_BAD_ATTRIBUTE_IN_THE_PAST] = "BAD_ATTRIBUTE_IN_THE_PAST",
-                [SK_SMART_OVERALL_BAD_SECTOR] = "BAD_SECTOR",
-                [SK_SMART_OVERALL_BAD_ATTRIBUTE_NOW] = "BAD_ATTRIBUTE_NOW",
-                [SK_SMART_OVERALL_BAD_SECTOR_MANY] = "BAD_SECTOR_MANY",
-                [SK_SMART_OVERALL_BAD_STATUS] = "BAD_STATUS",
-        };
-        /* %STRINGPOOLSTOP% */
+                if (left < ntohl(tsize)) {
+                        errno = EINVAL;
+                        return -1;
+                }
 
-        if (overall >= _SK_SMART_OVERALL_MAX)
-                return NULL;
+                switch (tag) {
 
-        return _P(map[overall]);
-}
+                        case SK_BLOB_TAG_IDENTIFY:
+                                if (ntohl(tsize) != sizeof(d->identify) || idv) {
+                                        errno = EINVAL;
+                                        return -1;
+                                }
+                                idv = TRUE;
+                                break;
 
-static uint64_t u64log2(uint64_t n) {
-        unsigned r;
+                        case SK_BLOB_TAG_SMART_STATUS:
+                                if (ntohl(tsize) != 4 || bssv) {
+                                        errno = EINVAL;
+                                        return -1;
+                                }
+                                bssv = TRUE;
+                                break;
 
-        if (n <= 1)
-                return 0;
+                        case SK_BLOB_TAG_SMART_DATA:
+                                if (ntohl(tsize) != sizeof(d->smart_data) || sdv) {
+                                        errno = EINVAL;
+                                        return -1;
+                                }
+                                sdv = TRUE;
+                                break;
 
-        r = 0;
-        for (;;) {
-                n = n >> 1;
-                if (!n)
-                        return r;
-                r++;
+                        case SK_BLOB_TAG_SMART_THRESHOLDS:
+                                if (ntohl(tsize) != sizeof(d->smart_thresholds) || stv) {
+                                        errno = EINVAL;
+                                        return -1;
+                                }
+                                stv = TRUE;
+                                break;
+                }
+
+                p = (uint32_t*) ((uint8_t*) p + ntohl(tsize));
+                left -= ntohl(tsize);
         }
-}
 
-int sk_disk_smart_get_overall(SkDisk *d, SkSmartOverall *overall) {
-        SkBool good;
-        uint64_t sectors, sector_threshold;
+        if (!idv) {
+                errno = -ENODATA;
+                return -1;
+        }
 
-        assert(d);
-        assert(overall);
+        disk_identify_invalidate(d);
 
-        /* First, check SMART self-assesment */
-        if (sk_disk_smart_status(d, &good) < 0)
-                return -1;
+        d->identify_valid = idv;
+        d->smart_data_valid = sdv;
+        d->smart_thresholds_valid = stv;
+        d->blob_smart_status_valid = bssv;
 
-        if (!good) {
-                *overall = SK_SMART_OVERALL_BAD_STATUS;
-                return 0;
-        }
+        /* Second run, actually copy things in */
+        p = blob;
+        left = size;
+        while (left > 0) {
+                uint32_t tag, tsize;
 
-        /* Second, check if the number of bad sectors is greater than
-         * a certain threshold */
-        if (sk_disk_smart_get_bad(d, &sectors) < 0) {
-                if (errno != ENOENT)
-                        return -1;
-                sectors = 0;
-        } else {
+                assert(left >= 8);
+                memcpy(&tag, p, 4);
+                memcpy(&tsize, p+1, 4);
+                p += 2;
+                left -= 8;
+
+                assert(left >= ntohl(tsize));
+
+                switch (tag) {
+
+                        case SK_BLOB_TAG_IDENTIFY:
+                                assert(ntohl(tsize) == sizeof(d->identify));
+                                memcpy(d->identify, p, sizeof(d->identify));
+                                break;
 
-                /* We use log2(n_sectors)*1024 as a threshold here. We
-                 * had to pick something, and this makes a bit of
-                 * sense, or doesn't it? */
-                sector_threshold = u64log2(d->size/512) * 1024;
+                        case SK_BLOB_TAG_SMART_STATUS: {
+                                uint32_t ok;
+                                assert(ntohl(tsize) == 4);
+                                memcpy(&ok, p, 4);
+                                d->blob_smart_status = !!ok;
+                                break;
+                        }
 
-                if (sectors >= sector_threshold) {
-                        *overall = SK_SMART_OVERALL_BAD_SECTOR_MANY;
-                        return 0;
-                }
-        }
+                        case SK_BLOB_TAG_SMART_DATA:
+                                assert(ntohl(tsize) == sizeof(d->smart_data));
+                                memcpy(d->smart_data, p, sizeof(d->smart_data));
+                                break;
 
-        /* Third, check if any of the SMART attributes is bad */
-        if (fill_cache (d) < 0)
-                return -1;
+                        case SK_BLOB_TAG_SMART_THRESHOLDS:
+                                assert(ntohl(tsize) == sizeof(d->smart_thresholds));
+                                memcpy(d->smart_thresholds, p, sizeof(d->smart_thresholds));
+                                break;
+                }
 
-        if (d->bad_attribute_now) {
-                *overall = SK_SMART_OVERALL_BAD_ATTRIBUTE_NOW;
-                return 0;
+                p = (uint32_t*) ((uint8_t*) p + ntohl(tsize));
+                left -= ntohl(tsize);
         }
 
-        /* Fourth, check if there are any bad sectors at all */
-        if (sectors > 0) {
-                *overall = SK_SMART_OVERALL_BAD_SECTOR;
-                return 0;
-        }
+        if (d->smart_data_valid)
+                build_attribute_index(d->smart_data, d->smart_data_index);
 
-        /* Fifth, check if any of the SMART attributes ever was bad */
-        if (d->bad_attribute_in_the_past) {
-                *overall = SK_SMART_OVERALL_BAD_ATTRIBUTE_IN_THE_PAST;
-                return 0;
-        }
+        if (d->smart_thresholds_valid)
+                build_attribute_index(d->smart_thresholds, d->smart_thresholds_index);
+
+        disk_new_generation(d);
 
-        /* Sixth, there's really nothing to complain about, so give it a pass */
-        *overall = SK_SMART_OVERALL_GOOD;
         return 0;
 }
 
-static char* print_name(char *s, size_t len, uint8_t id, const char *k) {
-
-        if (k)
-                strncpy(s, k, len);
-        else
-                snprintf(s, len, "%u", id);
+int sk_disk_set_blob(SkDisk *d, const void *blob, size_t size) {
+        int ret;
 
-        s[len-1] = 0;
+        disk_lock(d);
+        ret = disk_set_blob_unlocked(d, blob, size);
+        disk_unlock(d);
 
-        return s;
+        return ret;
 }
 
-static char *print_value(char *s, size_t len, uint64_t pretty_value, SkSmartAttributeUnit pretty_unit) {
+struct SkSnapshot {
+        unsigned ref;
 
-        switch (pretty_unit) {
-                case SK_SMART_ATTRIBUTE_UNIT_MSECONDS:
+        /* A blob disk that is not modified anymore once
+         * snapshot_seal() succeeded, so that any number of threads
+         * may read from it at the same time */
+        SkDisk disk;
 
-                        if (pretty_value >= 1000LLU*60LLU*60LLU*24LLU*365LLU)
-                                snprintf(s, len, "%0.1f years", ((double) pretty_value)/(1000.0*60*60*24*365));
-                        else if (pretty_value >= 1000LLU*60LLU*60LLU*24LLU*30LLU)
-                                snprintf(s, len, "%0.1f months", ((double) pretty_value)/(1000.0*60*60*24*30));
-                        else if (pretty_value >= 1000LLU*60LLU*60LLU*24LLU)
-                                snprintf(s, len, "%0.1f days", ((double) pretty_value)/(1000.0*60*60*24));
-                        else if (pretty_value >= 1000LLU*60LLU*60LLU)
-                                snprintf(s, len, "%0.1f h", ((double) pretty_value)/(1000.0*60*60));
-                        else if (pretty_value >= 1000LLU*60LLU)
-                                snprintf(s, len, "%0.1f min", ((double) pretty_value)/(1000.0*60));
-                        else if (pretty_value >= 1000LLU)
-                                snprintf(s, len, "%0.1f s", ((double) pretty_value)/(1000.0));
-                        else
-                                snprintf(s, len, "%llu ms", (unsigned long long) pretty_value);
+        size_t blob_size;
 
-                        break;
+        /* Only filled in by sk_disk_acquire() */
+        SkSnapshotTimings timings;
+};
 
-                case SK_SMART_ATTRIBUTE_UNIT_MKELVIN:
-                        snprintf(s, len, "%0.1f C", ((double) pretty_value - 273150) / 1000);
-                        break;
+static int snapshot_new(SkSnapshot **_s) {
+        SkSnapshot *s;
 
-                case SK_SMART_ATTRIBUTE_UNIT_SECTORS:
-                        snprintf(s, len, "%llu sectors", (unsigned long long) pretty_value);
-                        break;
+        if (!(s = calloc(1, sizeof(SkSnapshot)))) {
+                errno = ENOMEM;
+                return -1;
+        }
 
-                case SK_SMART_ATTRIBUTE_UNIT_PERCENT:
-                        snprintf(s, len, "%llu%%", (unsigned long long) pretty_value);
-                        break;
+        s->ref = 1;
+        s->disk.fd = -1;
+        s->disk.type = SK_DISK_TYPE_BLOB;
+        s->disk.size = (uint64_t) -1;
+        s->disk.generation = 1;
 
-                case SK_SMART_ATTRIBUTE_UNIT_SMALL_PERCENT:
-                        snprintf(s, len, "%0.3f%%", (double) pretty_value);
-                        break;
+        /* Never issue any commands on behalf of a snapshot */
+        s->disk.smart_initialized = TRUE;
 
-                case SK_SMART_ATTRIBUTE_UNIT_MB:
-                        if (pretty_value >= 1000000LLU)
-                          snprintf(s, len, "%0.3f TB",  (double) pretty_value / 1000000LLU);
-                        else if (pretty_value >= 1000LLU)
-                          snprintf(s, len, "%0.3f GB",  (double) pretty_value / 1000LLU);
-                        else
-                          snprintf(s, len, "%llu MB", (unsigned long long) pretty_value);
-                        break;
+        *_s = s;
+        return 0;
+}
 
-                case SK_SMART_ATTRIBUTE_UNIT_NONE:
-                        snprintf(s, len, "%llu", (unsigned long long) pretty_value);
-                        break;
+/* Fill in every cache the read functions would otherwise fill in
+ * lazily, so that reading a snapshot never writes to it */
+static int snapshot_seal(SkSnapshot *s) {
+        SkDisk *d = &s->disk;
+        const SkIdentifyParsedData *ipd;
+        const SkSmartParsedData *spd;
+        const SkSmartSummary *summary;
+        SkSmartQuirk quirk;
+        const void *blob;
 
-                case SK_SMART_ATTRIBUTE_UNIT_UNKNOWN:
-                        snprintf(s, len, "n/a");
-                        break;
+        if (sk_disk_identify_parse(d, &ipd) < 0)
+                return -1;
 
-                case _SK_SMART_ATTRIBUTE_UNIT_MAX:
-                        assert(FALSE);
-        }
+        if (disk_lookup_quirks(d, &quirk) < 0)
+                return -1;
 
-        s[len-1] = 0;
+        if (d->smart_data_valid) {
+                if (sk_disk_smart_parse(d, &spd) < 0)
+                        return -1;
 
-        return s;
+                if (sk_disk_smart_get_summary(d, &summary) < 0)
+                        return -1;
+        }
+
+        return sk_disk_get_blob(d, &blob, &s->blob_size);
 }
 
-#define HIGHLIGHT "\x1B[1m"
-#define ENDHIGHLIGHT "\x1B[0m"
+typedef enum SkSnapshotStatus {
+        SK_SNAPSHOT_STATUS_QUERY, /* ask the disk if need be */
+        SK_SNAPSHOT_STATUS_KNOWN, /* only a status we know already */
+        SK_SNAPSHOT_STATUS_NONE   /* leave it out, unless it came with a blob */
+} SkSnapshotStatus;
 
-static void disk_dump_attributes(SkDisk *d, const SkSmartAttributeParsedData *a, void* userdata) {
-        char name[32];
-        char pretty[32];
-        char tt[32], tw[32], tc[32];
-        SkBool highlight;
+static int disk_snapshot_unlocked(SkDisk *d, SkSnapshotStatus status, SkSnapshot **_s) {
+        SkSnapshot *s;
+        SkBool good, have_good;
 
-        snprintf(tt, sizeof(tt), "%3u", a->threshold);
-        tt[sizeof(tt)-1] = 0;
-        snprintf(tw, sizeof(tw), "%3u", a->worst_value);
-        tw[sizeof(tw)-1] = 0;
-        snprintf(tc, sizeof(tc), "%3u", a->current_value);
-        tc[sizeof(tc)-1] = 0;
+        assert(d);
+        assert(_s);
 
-        highlight = a->warn && isatty(1);
+        if (!d->identify_valid) {
+                errno = ENODATA;
+                return -1;
+        }
 
-        if (highlight)
-                fprintf(stderr, HIGHLIGHT);
+        /* Same as for sk_disk_get_blob(), the status is included if
+         * we can get it. Unless we may ask the disk, only a status we
+         * know already is used. */
+        if (status == SK_SNAPSHOT_STATUS_QUERY || d->type == SK_DISK_TYPE_BLOB)
+                have_good = disk_smart_status_cached(d, &good) >= 0;
+        else if (status == SK_SNAPSHOT_STATUS_KNOWN && d->status_valid) {
+                good = d->status_good;
+                have_good = TRUE;
+        } else
+                have_good = FALSE;
 
-        printf("%3u %-27s %-3s   %-3s   %-3s   %-11s 0x%02x%02x%02x%02x%02x%02x %-7s %-7s %-4s %-4s\n",
-               a->id,
-               print_name(name, sizeof(name), a->id, a->name),
-               a->current_value_valid ? tc : "n/a",
-               a->worst_value_valid ? tw : "n/a",
-               a->threshold_valid ? tt : "n/a",
-               print_value(pretty, sizeof(pretty), a->pretty_value, a->pretty_unit),
-               a->raw[0], a->raw[1], a->raw[2], a->raw[3], a->raw[4], a->raw[5],
-               a->prefailure ? "prefail" : "old-age",
-               a->online ? "online" : "offline",
-               a->good_now_valid ? yes_no(a->good_now) : "n/a",
-               a->good_in_the_past_valid ? yes_no(a->good_in_the_past) : "n/a");
+        if (snapshot_new(&s) < 0)
+                return -1;
 
-        if (highlight)
-                fprintf(stderr, ENDHIGHLIGHT);
-}
+        s->disk.size = d->size;
 
-int sk_disk_dump(SkDisk *d) {
-        int ret;
-        SkBool awake = FALSE;
-        uint64_t size;
+        memcpy(s->disk.identify, d->identify, sizeof(s->disk.identify));
+        s->disk.identify_valid = TRUE;
 
-        assert(d);
+        if (d->smart_data_valid) {
+                memcpy(s->disk.smart_data, d->smart_data, sizeof(s->disk.smart_data));
+                memcpy(s->disk.smart_data_index, d->smart_data_index, sizeof(s->disk.smart_data_index));
+                s->disk.smart_data_valid = TRUE;
+        }
 
-        printf("Device: %s%s%s\n"
-               "Type: %s\n",
-               d->name ? disk_type_to_prefix_string(d->type) : "",
-               d->name ? ":" : "",
-               d->name ? d->name : "n/a",
-               disk_type_to_human_string(d->type));
+        if (d->smart_thresholds_valid) {
+                memcpy(s->disk.smart_thresholds, d->smart_thresholds, sizeof(s->disk.smart_thresholds));
+                memcpy(s->disk.smart_thresholds_index, d->smart_thresholds_index, sizeof(s->disk.smart_thresholds_index));
+                s->disk.smart_thresholds_valid = TRUE;
+        }
 
-        ret = sk_disk_get_size(d, &size);
-        if (ret >= 0)
-                printf("Size: %lu MiB\n", (unsigned long) (d->size/1024/1024));
-        else
-                printf("Size: %s\n", strerror(errno));
+        if (have_good) {
+                s->disk.blob_smart_status = good;
+                s->disk.blob_smart_status_valid = TRUE;
+        }
 
-        if (d->identify_valid) {
-                const SkIdentifyParsedData *ipd;
-                SkSmartQuirk quirk = 0;
-                unsigned i;
+        if (snapshot_seal(s) < 0) {
+                sk_snapshot_unref(s);
+                return -1;
+        }
 
-                if ((ret = sk_disk_identify_parse(d, &ipd)) < 0)
-                        return ret;
+        *_s = s;
+        return 0;
+}
 
-                printf("Model: [%s]\n"
-                       "Serial: [%s]\n"
-                       "Firmware: [%s]\n"
-                       "SMART Available: %s\n",
-                       ipd->model,
-                       ipd->serial,
-                       ipd->firmware,
-                       yes_no(disk_smart_is_available(d)));
+int sk_disk_snapshot(SkDisk *d, SkSnapshot **_s) {
+        int ret;
 
-                if ((ret = lookup_quirks(ipd->model, ipd->firmware, &quirk)))
-                        return ret;
+        disk_lock(d);
+        ret = disk_snapshot_unlocked(d, SK_SNAPSHOT_STATUS_QUERY, _s);
+        disk_unlock(d);
 
-                printf("Quirks:");
+        return ret;
+}
 
-                for (i = 0; quirk_name[i]; i++)
-                        if (quirk & (1<<i))
-                                printf(" %s", _P(quirk_name[i]));
+static void disk_publish_snapshot(SkDisk *d) {
+        SkSnapshot *s, *old;
 
-                printf("\n");
-        }
+        /* If this fails readers keep seeing the previous snapshot
+         * and we try again after the next command */
+        if (disk_snapshot_unlocked(d, SK_SNAPSHOT_STATUS_KNOWN, &s) < 0)
+                return;
 
-        ret = sk_disk_check_sleep_mode(d, &awake);
-        printf("Awake: %s\n",
-               ret >= 0 ? yes_no(awake) : strerror(errno));
+        pthread_mutex_lock(&d->snapshot_lock);
+        old = d->snapshot;
+        d->snapshot = s;
+        pthread_mutex_unlock(&d->snapshot_lock);
 
-        if (disk_smart_is_available(d)) {
-                SkSmartOverall overall;
-                const SkSmartParsedData *spd;
-                SkBool good;
-                char pretty[32];
-                uint64_t value, power_on;
+        d->snapshot_generation = d->generation;
+        d->snapshot_status_valid = d->status_valid;
+        d->snapshot_status_good = d->status_good;
 
-                ret = sk_disk_smart_status(d, &good);
-                printf("%sSMART Disk Health Good: %s%s\n",
-                       ret >= 0 && !good ? HIGHLIGHT : "",
-                       ret >= 0 ? yes_no(good) : strerror(errno),
-                       ret >= 0 && !good ? ENDHIGHLIGHT : "");
-                if ((ret = sk_disk_smart_read_data(d)) < 0)
-                        return ret;
+        sk_snapshot_unref(old);
+}
 
-                if ((ret = sk_disk_smart_parse(d, &spd)) < 0)
-                        return ret;
+static int disk_acquire_unlocked(SkDisk *d, unsigned flags, SkSnapshot **_s) {
+        SkSnapshotTimings t;
+        SkSnapshot *s;
+        SkBool b, status_read = FALSE;
+        uint64_t begin, start;
 
-                printf("Off-line Data Collection Status: [%s]\n"
-                       "Total Time To Complete Off-Line Data Collection: %u s\n"
-                       "Self-Test Execution Status: [%s]\n"
-                       "Percent Self-Test Remaining: %u%%\n"
-                       "Conveyance Self-Test Available: %s\n"
-                       "Short/Extended Self-Test Available: %s\n"
-                       "Start Self-Test Available: %s\n"
-                       "Abort Self-Test Available: %s\n"
-                       "Short Self-Test Polling Time: %u min\n"
-                       "Extended Self-Test Polling Time: %u min\n"
-                       "Conveyance Self-Test Polling Time: %u min\n",
-                       sk_smart_offline_data_collection_status_to_string(spd->offline_data_collection_status),
-                       spd->total_offline_data_collection_seconds,
-                       sk_smart_self_test_execution_status_to_string(spd->self_test_execution_status),
-                       spd->self_test_execution_percent_remaining,
-                       yes_no(spd->conveyance_test_available),
-                       yes_no(spd->short_and_extended_test_available),
-                       yes_no(spd->start_test_available),
-                       yes_no(spd->abort_test_available),
-                       spd->short_test_polling_minutes,
-                       spd->extended_test_polling_minutes,
-                       spd->conveyance_test_polling_minutes);
+        if (flags & ~(SK_DISK_ACQUIRE_NO_WAKEUP|SK_DISK_ACQUIRE_NO_STATUS)) {
+                errno = EINVAL;
+                return -1;
+        }
 
-                if (sk_disk_smart_get_bad(d, &value) < 0)
-                        printf("Bad Sectors: %s\n", strerror(errno));
-                else
-                        printf("%sBad Sectors: %s%s\n",
-                               value > 0 ? HIGHLIGHT : "",
-                               print_value(pretty, sizeof(pretty), value, SK_SMART_ATTRIBUTE_UNIT_SECTORS),
-                               value > 0 ? ENDHIGHLIGHT : "");
+        memset(&t, 0, sizeof(t));
+        begin = now_usec();
 
-                if (sk_disk_smart_get_power_on(d, &power_on) < 0) {
-                        printf("Powered On: %s\n", strerror(errno));
-                        power_on = 0;
-                } else
-                        printf("Powered On: %s\n", print_value(pretty, sizeof(pretty), power_on, SK_SMART_ATTRIBUTE_UNIT_MSECONDS));
+        if (d->type != SK_DISK_TYPE_BLOB && disk_smart_is_available(d)) {
 
-                if (sk_disk_smart_get_power_cycle(d, &value) < 0)
-                        printf("Power Cycles: %s\n", strerror(errno));
-                else {
-                        printf("Power Cycles: %llu\n", (unsigned long long) value);
+                if (flags & SK_DISK_ACQUIRE_NO_WAKEUP) {
+                        start = now_usec();
+                        if (sk_disk_check_sleep_mode(d, &b) < 0)
+                                return -1;
+                        t.check_power_mode_usec = now_usec() - start;
 
-                        if (value > 0 && power_on > 0)
-                                printf("Average Powered On Per Power Cycle: %s\n", print_value(pretty, sizeof(pretty), power_on/value, SK_SMART_ATTRIBUTE_UNIT_MSECONDS));
+                        if (!b) {
+                                errno = EAGAIN;
+                                return -1;
+                        }
                 }
 
-                if (sk_disk_smart_get_temperature(d, &value) < 0)
-                        printf("Temperature: %s\n", strerror(errno));
-                else
-                        printf("Temperature: %s\n", print_value(pretty, sizeof(pretty), value, SK_SMART_ATTRIBUTE_UNIT_MKELVIN));
+                /* On first use this enables SMART and reads the
+                 * thresholds, otherwise it sends nothing */
+                if (!d->smart_initialized) {
+                        start = now_usec();
+                        if (init_smart(d) < 0)
+                                return -1;
+                        t.smart_read_thresholds_usec = now_usec() - start;
+                }
 
-                printf("Attribute Parsing Verification: %s\n",
-                       d->attribute_verification_bad ? "Bad" : "Good");
+                if (!(flags & SK_DISK_ACQUIRE_NO_STATUS)) {
+                        start = now_usec();
+                        if (sk_disk_smart_status(d, &b) < 0)
+                                return -1;
+                        t.smart_status_usec = now_usec() - start;
 
-                if (sk_disk_smart_get_overall(d, &overall) < 0)
-                        printf("Overall Status: %s\n", strerror(errno));
-                else
-                        printf("%sOverall Status: %s%s\n",
-                               overall != SK_SMART_OVERALL_GOOD ? HIGHLIGHT : "",
-                               sk_smart_overall_to_string(overall),
-                               overall != SK_SMART_OVERALL_GOOD ? ENDHIGHLIGHT : "");
+                        /* Not if the refresh policy answered from the cache */
+                        status_read = d->status_usec >= start;
+                }
 
-                printf("%3s %-27s %5s %5s %5s %-11s %-14s %-7s %-7s %-4s %-4s\n",
-                       "ID#",
-                       "Name",
-                       "Value",
-                       "Worst",
-                       "Thres",
-                       "Pretty",
-                       "Raw",
-                       "Type",
-                       "Updates",
-                       "Good",
-                       "Good/Past");
+                start = now_usec();
+                if (sk_disk_smart_read_data(d) < 0)
+                        return -1;
+                t.smart_read_data_usec = now_usec() - start;
 
-                if ((ret = sk_disk_smart_parse_attributes(d, disk_dump_attributes, NULL)) < 0)
-                        return ret;
-        } else
-                printf("ATA SMART not supported.\n");
+                /* The status goes with the data read right after it,
+                 * so that disk_smart_status_cached() doesn't ask for it
+                 * again */
+                if (status_read && d->status_usec < d->smart_data_usec)
+                        d->status_usec = d->smart_data_usec;
+
+                if (!d->smart_thresholds_valid) {
+                        start = now_usec();
+                        if (disk_smart_read_thresholds(d) < 0)
+                                return -1;
+                        t.smart_read_thresholds_usec += now_usec() - start;
+                }
+        }
+
+        /* With SK_DISK_ACQUIRE_NO_STATUS a status from some earlier
+         * call might be arbitrarily old, so it is left out */
+        if (disk_snapshot_unlocked(d, (flags & SK_DISK_ACQUIRE_NO_STATUS) ? SK_SNAPSHOT_STATUS_NONE : SK_SNAPSHOT_STATUS_KNOWN, &s) < 0)
+                return -1;
+
+        t.total_usec = now_usec() - begin;
+
+        /* Nobody else knows about this snapshot yet */
+        s->timings = t;
 
+        *_s = s;
         return 0;
 }
 
-int sk_disk_get_size(SkDisk *d, uint64_t *bytes) {
+int sk_disk_acquire(SkDisk *d, unsigned flags, SkSnapshot **s) {
+        int ret;
+
         assert(d);
-        assert(bytes);
+        assert(s);
 
-        if (d->size == (uint64_t) -1) {
+        disk_lock(d);
+        ret = disk_acquire_unlocked(d, flags, s);
+        disk_unlock(d);
+
+        return ret;
+}
+
+int sk_disk_get_snapshot(SkDisk *d, SkSnapshot **s) {
+        assert(d);
+        assert(s);
+
+        if (!d->locks_initialized) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        /* Never waits for d->lock, i.e. for commands in progress */
+        pthread_mutex_lock(&d->snapshot_lock);
+
+        if (!d->thread_safe) {
+                pthread_mutex_unlock(&d->snapshot_lock);
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        if ((*s = d->snapshot))
+                sk_snapshot_ref(*s);
+
+        pthread_mutex_unlock(&d->snapshot_lock);
+
+        if (!*s) {
                 errno = ENODATA;
                 return -1;
         }
 
-        *bytes = d->size;
         return 0;
 }
 
-static int disk_find_type(SkDisk *d, dev_t devnum) {
-        struct udev *udev;
-        struct udev_device *dev = NULL, *usb;
-        int r = -1;
-        const char *a;
+int sk_snapshot_new_from_blob(const void *blob, size_t size, SkSnapshot **_s) {
+        SkSnapshot *s;
 
-        assert(d);
+        assert(blob);
+        assert(_s);
 
-        if (!(udev = udev_new())) {
-                errno = ENXIO;
-                goto finish;
-        }
+        if (snapshot_new(&s) < 0)
+                return -1;
 
-        if (!(dev = udev_device_new_from_devnum(udev, 'b', devnum))) {
-                errno = ENODEV;
-                goto finish;
+        if (sk_disk_set_blob(&s->disk, blob, size) < 0 ||
+            snapshot_seal(s) < 0) {
+                sk_snapshot_unref(s);
+                return -1;
         }
 
-        if ((a = udev_device_get_property_value(dev, "ID_ATA_SMART_ACCESS"))) {
-                unsigned u;
-
-                for (u = 0; u < _SK_DISK_TYPE_MAX; u++) {
-                        const char *t;
+        *_s = s;
+        return 0;
+}
 
-                        if (!(t = disk_type_to_prefix_string(u)))
-                                continue;
+SkSnapshot* sk_snapshot_ref(SkSnapshot *s) {
+        assert(s);
 
-                        if (!strcmp(a, t)) {
-                                d->type = u;
-                                r = 0;
-                                goto finish;
-                        }
-                }
+        __sync_add_and_fetch(&s->ref, 1);
+        return s;
+}
 
-                d->type = SK_DISK_TYPE_NONE;
-                r = 0;
-                goto finish;
-        }
+void sk_snapshot_unref(SkSnapshot *s) {
 
-        if ((usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device"))) {
-                const char *product, *vendor;
-                uint32_t pid, vid;
+        if (!s)
+                return;
 
-                if (!(product = udev_device_get_sysattr_value(usb, "idProduct")) ||
-                    sscanf(product, "%04x", &pid) != 1) {
-                        errno = ENODEV;
-                        goto finish;
-                }
+        if (__sync_sub_and_fetch(&s->ref, 1) > 0)
+                return;
 
-                if (!(vendor = udev_device_get_sysattr_value(usb, "idVendor")) ||
-                    sscanf(vendor, "%04x", &vid) != 1) {
-                        errno = ENODEV;
-                        goto finish;
-                }
+        free(s);
+}
 
-                if ((vid == 0x0928 && pid == 0x0000))
-                        /* This Oxford Semiconductor bridge seems to
-                         * choke on SAT commands. Let's explicitly
-                         * black list it here.
-                         *
-                         * http://bugs.freedesktop.org/show_bug.cgi?id=24951 */
-                        d->type = SK_DISK_TYPE_NONE;
-                else if ((vid == 0x152d && pid == 0x2329) ||
-                         (vid == 0x152d && pid == 0x2338) ||
-                         (vid == 0x152d && pid == 0x2339))
-                        /* Some JMicron bridges seem to choke on SMART
-                         * commands, so let's explicitly black list
-                         * them here.
-                         *
-                         * https://bugzilla.redhat.com/show_bug.cgi?id=515881
-                         *
-                         * At least some of the JMicron bridges with
-                         * these vids/pids choke on the jmicron access
-                         * mode. To make sure we don't break things
-                         * for people we now disable this by
-                         * default. */
-                        d->type = SK_DISK_TYPE_NONE;
-                else if ((vid == 0x152d && pid == 0x2336))
-                        /* This JMicron bridge seems to always work
-                         * with SMART commands send with the jmicron
-                         * access mode. */
-                        d->type = SK_DISK_TYPE_JMICRON;
-                else if ((vid == 0x0c0b && pid == 0xb159) ||
-                    (vid == 0x04fc && pid == 0x0c25) ||
-                    (vid == 0x04fc && pid == 0x0c15))
-                        d->type = SK_DISK_TYPE_SUNPLUS;
-                else
-                        d->type = SK_DISK_TYPE_ATA_PASSTHROUGH_12;
+int sk_snapshot_get_blob(SkSnapshot *s, const void **blob, size_t *size) {
+        assert(s);
+        assert(blob);
+        assert(size);
 
-        } else if (udev_device_get_parent_with_subsystem_devtype(dev, "ide", NULL))
-                d->type = SK_DISK_TYPE_LINUX_IDE;
-        else if (udev_device_get_parent_with_subsystem_devtype(dev, "scsi", NULL))
-                d->type = SK_DISK_TYPE_ATA_PASSTHROUGH_16;
-        else
-                d->type = SK_DISK_TYPE_AUTO;
+        *blob = s->disk.blob;
+        *size = s->blob_size;
+        return 0;
+}
 
-        r = 0;
+int sk_snapshot_get_timings(SkSnapshot *s, const SkSnapshotTimings **timings) {
+        assert(s);
+        assert(timings);
 
-finish:
-        if (dev)
-                udev_device_unref(dev);
+        *timings = &s->timings;
+        return 0;
+}
 
-        if (udev)
-                udev_unref(udev);
+int sk_snapshot_get_size(SkSnapshot *s, uint64_t *bytes) {
+        assert(s);
 
-        return r;
+        return sk_disk_get_size(&s->disk, bytes);
 }
 
-static int init_smart(SkDisk *d) {
-        /* We don't do the SMART initialization right-away, since some
-         * drivers spin up when we do that */
+int sk_snapshot_identify_is_available(SkSnapshot *s, SkBool *available) {
+        assert(s);
 
-        int ret;
+        return sk_disk_identify_is_available(&s->disk, available);
+}
 
-        if (d->smart_initialized)
-                return 0;
+int sk_snapshot_identify_parse(SkSnapshot *s, const SkIdentifyParsedData **data) {
+        assert(s);
 
-        d->smart_initialized = TRUE;
+        return sk_disk_identify_parse(&s->disk, data);
+}
 
-        /* Check if driver can do SMART, and enable if necessary */
-        if (!disk_smart_is_available(d))
-                return 0;
+int sk_snapshot_smart_is_available(SkSnapshot *s, SkBool *available) {
+        assert(s);
 
-        if (!disk_smart_is_enabled(d)) {
-                if ((ret = disk_smart_enable(d, TRUE)) < 0)
-                        goto fail;
+        return sk_disk_smart_is_available(&s->disk, available);
+}
 
-                if ((ret = disk_identify_device(d)) < 0)
-                        goto fail;
+int sk_snapshot_smart_status(SkSnapshot *s, SkBool *good) {
+        assert(s);
 
-                if (!disk_smart_is_enabled(d)) {
-                        errno = EIO;
-                        ret = -1;
-                        goto fail;
-                }
-        }
+        return sk_disk_smart_status(&s->disk, good);
+}
 
-        disk_smart_read_thresholds(d);
-        ret = 0;
+int sk_snapshot_smart_parse(SkSnapshot *s, const SkSmartParsedData **data) {
+        assert(s);
 
-fail:
-        return ret;
+        return sk_disk_smart_parse(&s->disk, data);
 }
 
-int sk_disk_open(const char *name, SkDisk **_d) {
-        SkDisk *d;
-        int ret = -1;
-        struct stat st;
+struct snapshot_parse_helper {
+        SkSnapshot *snapshot;
+        SkSnapshotAttributeParseCallback cb;
+        void *userdata;
+};
 
-        assert(_d);
+static void snapshot_parse_cb(SkDisk *d, const SkSmartAttributeParsedData *a, struct snapshot_parse_helper *h) {
+        h->cb(h->snapshot, a, h->userdata);
+}
 
-        if (!(d = calloc(1, sizeof(SkDisk)))) {
-                errno = ENOMEM;
-                goto fail;
-        }
+int sk_snapshot_smart_parse_attributes(SkSnapshot *s, SkSnapshotAttributeParseCallback cb, void* userdata) {
+        struct snapshot_parse_helper h;
 
-        d->fd = -1;
-        d->size = (uint64_t) -1;
+        assert(s);
+        assert(cb);
 
-        if (!name)
-                d->type = SK_DISK_TYPE_BLOB;
-        else {
-                const char *dn;
+        h.snapshot = s;
+        h.cb = cb;
+        h.userdata = userdata;
 
-                d->type = SK_DISK_TYPE_AUTO;
+        return sk_disk_smart_parse_attributes(&s->disk, (SkSmartAttributeParseCallback) snapshot_parse_cb, &h);
+}
 
-                if (!(dn = disk_type_from_string(name, &d->type)))
-                        dn = name;
+int sk_snapshot_smart_parse_attributes_masked(SkSnapshot *s, const uint8_t mask[SK_SMART_ATTRIBUTE_MASK_SIZE], SkSnapshotAttributeParseCallback cb, void* userdata) {
+        struct snapshot_parse_helper h;
 
-                if (!(d->name = strdup(dn))) {
-                        errno = ENOMEM;
-                        goto fail;
-                }
+        assert(s);
+        assert(cb);
 
-                if ((d->fd = open(d->name,
-                                  O_RDONLY|O_NOCTTY|O_NONBLOCK
-#ifdef O_CLOEXEC
-                                  |O_CLOEXEC
-#endif
+        h.snapshot = s;
+        h.cb = cb;
+        h.userdata = userdata;
 
-                     )) < 0) {
-                        ret = d->fd;
-                        goto fail;
-                }
+        return sk_disk_smart_parse_attributes_masked(&s->disk, mask, (SkSmartAttributeParseCallback) snapshot_parse_cb, &h);
+}
 
-                if ((ret = fstat(d->fd, &st)) < 0)
-                        goto fail;
+int sk_snapshot_smart_get_attributes(SkSnapshot *s, SkSmartAttributeParsedData *a, size_t n_max, size_t *n) {
+        assert(s);
 
-                if (!S_ISBLK(st.st_mode)) {
-                        errno = ENODEV;
-                        ret = -1;
-                        goto fail;
-                }
+        return sk_disk_smart_get_attributes(&s->disk, a, n_max, n);
+}
 
-                /* So, it's a block device. Let's make sure the ioctls work */
-                if ((ret = ioctl(d->fd, BLKGETSIZE64, &d->size)) < 0)
-                        goto fail;
+int sk_snapshot_smart_get_attribute(SkSnapshot *s, uint8_t id, SkSmartAttributeParsedData *a) {
+        assert(s);
 
-                if (d->size <= 0 || d->size == (uint64_t) -1) {
-                        errno = EIO;
-                        ret = -1;
-                        goto fail;
-                }
+        return sk_disk_smart_get_attribute(&s->disk, id, a);
+}
 
-                /* OK, it's a real block device with a size. Now let's find the suitable API */
-                if (d->type == SK_DISK_TYPE_AUTO)
-                        if ((ret = disk_find_type(d, st.st_rdev)) < 0)
-                                goto fail;
+int sk_snapshot_smart_get_summary(SkSnapshot *s, const SkSmartSummary **summary) {
+        assert(s);
 
-                if (d->type == SK_DISK_TYPE_AUTO) {
-                        /* We have no clue, so let's autotest for a working API */
-                        for (d->type = 0; d->type < _SK_DISK_TYPE_TEST_MAX; d->type++)
-                                if (disk_identify_device(d) >= 0)
-                                        break;
-                        if (d->type >= _SK_DISK_TYPE_TEST_MAX)
-                                d->type = SK_DISK_TYPE_NONE;
-                } else
-                        disk_identify_device(d);
-        }
+        return sk_disk_smart_get_summary(&s->disk, summary);
+}
 
-        *_d = d;
+int sk_snapshot_smart_get_power_on(SkSnapshot *s, uint64_t *mseconds) {
+        assert(s);
 
-        return 0;
+        return sk_disk_smart_get_power_on(&s->disk, mseconds);
+}
 
-fail:
+int sk_snapshot_smart_get_power_cycle(SkSnapshot *s, uint64_t *count) {
+        assert(s);
 
-        if (d)
-                sk_disk_free(d);
+        return sk_disk_smart_get_power_cycle(&s->disk, count);
+}
 
-        return ret;
+int sk_snapshot_smart_get_bad(SkSnapshot *s, uint64_t *sectors) {
+        assert(s);
+
+        return sk_disk_smart_get_bad(&s->disk, sectors);
 }
 
-void sk_disk_free(SkDisk *d) {
-        assert(d);
+int sk_snapshot_smart_get_temperature(SkSnapshot *s, uint64_t *mkelvin) {
+        assert(s);
 
-        if (d->fd >= 0)
-                close(d->fd);
+        return sk_disk_smart_get_temperature(&s->disk, mkelvin);
+}
 
-        free(d->name);
-        free(d->blob);
-        free(d);
+int sk_snapshot_smart_get_overall(SkSnapshot *s, SkSmartOverall *overall) {
+        assert(s);
+
+        return sk_disk_smart_get_overall(&s->disk, overall);
 }
 
-int sk_disk_get_blob(SkDisk *d, const void **blob, size_t *rsize) {
-        size_t size;
-        SkBool good, have_good = FALSE;
-        uint32_t *p;
+struct SkDiskGroup {
+        unsigned max_workers;
 
-        assert(d);
-        assert(blob);
-        assert(rsize);
+        unsigned n_disks, n_allocated;
+        SkDiskGroupResult *results;
 
-        size =
-                (d->identify_valid ? 8 + sizeof(d->identify) : 0) +
-                (d->smart_data_valid ? 8 + sizeof(d->smart_data) : 0) +
-                (d->smart_thresholds_valid ? 8 + sizeof(d->smart_thresholds) : 0);
+        /* The batch currently being worked on */
+        void (*job)(SkDiskGroupResult *r, unsigned flags);
+        unsigned flags;
+        unsigned next;
+};
 
-        if (sk_disk_smart_status(d, &good) >= 0) {
-                size += 12;
-                have_good = TRUE;
-        }
+int sk_disk_group_new(unsigned max_workers, SkDiskGroup **_g) {
+        SkDiskGroup *g;
 
-        if (size <= 0) {
-                errno = ENODATA;
+        assert(_g);
+
+        if (max_workers <= 0) {
+                errno = EINVAL;
                 return -1;
         }
 
-        free(d->blob);
-        if (!(d->blob = malloc(size))) {
+        if (!(g = calloc(1, sizeof(SkDiskGroup)))) {
                 errno = ENOMEM;
                 return -1;
         }
 
-        p = d->blob;
-
-        /* These memory accesses are only OK as long as all our
-         * objects are sensibly aligned, which they are... */
+        g->max_workers = max_workers;
 
-        if (d->identify_valid) {
-                p[0] = SK_BLOB_TAG_IDENTIFY;
-                p[1] = htonl(sizeof(d->identify));
-                p += 2;
+        *_g = g;
+        return 0;
+}
 
-                memcpy(p, d->identify, sizeof(d->identify));
-                p = (uint32_t*) ((uint8_t*) p + sizeof(d->identify));
-        }
+void sk_disk_group_free(SkDiskGroup *g) {
+        unsigned i;
 
-        if (have_good) {
-                p[0] = SK_BLOB_TAG_SMART_STATUS;
-                p[1] = htonl(4);
-                p[2] = htonl(!!good);
-                p += 3;
-        }
+        if (!g)
+                return;
 
-        if (d->smart_data_valid) {
-                p[0] = SK_BLOB_TAG_SMART_DATA;
-                p[1] = htonl(sizeof(d->smart_data));
-                p += 2;
+        for (i = 0; i < g->n_disks; i++) {
+                if (g->results[i].disk)
+                        sk_disk_free(g->results[i].disk);
 
-                memcpy(p, d->smart_data, sizeof(d->smart_data));
-                p = (uint32_t*) ((uint8_t*) p + sizeof(d->smart_data));
+                free((char*) g->results[i].name);
         }
 
-        if (d->smart_thresholds_valid) {
-                p[0] = SK_BLOB_TAG_SMART_THRESHOLDS;
-                p[1] = htonl(sizeof(d->smart_thresholds));
-                p += 2;
+        free(g->results);
+        free(g);
+}
 
-                memcpy(p, d->smart_thresholds, sizeof(d->smart_thresholds));
-                p = (uint32_t*) ((uint8_t*) p + sizeof(d->smart_thresholds));
-        }
+int sk_disk_group_add(SkDiskGroup *g, const char *name, unsigned *idx) {
+        SkDiskGroupResult *r;
 
-        assert((size_t) ((uint8_t*) p - (uint8_t*) d->blob) == size);
+        assert(g);
+        assert(name);
 
-        *blob = d->blob;
-        *rsize = size;
+        if (g->n_disks >= g->n_allocated) {
+                unsigned n;
 
-        return 0;
-}
+                n = g->n_allocated > 0 ? g->n_allocated * 2 : 16;
 
-int sk_disk_set_blob(SkDisk *d, const void *blob, size_t size) {
-        const uint32_t *p;
-        size_t left;
-        SkBool idv = FALSE, sdv = FALSE, stv = FALSE, bssv = FALSE;
+                if (!(r = realloc(g->results, sizeof(SkDiskGroupResult) * n))) {
+                        errno = ENOMEM;
+                        return -1;
+                }
 
-        assert(d);
-        assert(blob);
+                g->results = r;
+                g->n_allocated = n;
+        }
 
-        if (d->type != SK_DISK_TYPE_BLOB) {
-                errno = ENODEV;
+        r = g->results + g->n_disks;
+        memset(r, 0, sizeof(SkDiskGroupResult));
+
+        if (!(r->name = strdup(name))) {
+                errno = ENOMEM;
                 return -1;
         }
 
-        if (size <= 0) {
+        if (idx)
+                *idx = g->n_disks;
+
+        g->n_disks++;
+        return 0;
+}
+
+int sk_disk_group_get(SkDiskGroup *g, unsigned i, const SkDiskGroupResult **r) {
+        assert(g);
+        assert(r);
+
+        if (i >= g->n_disks) {
                 errno = EINVAL;
                 return -1;
         }
 
-        /* First run, verify if everything makes sense */
-        p = blob;
-        left = size;
-        while (left > 0) {
-                uint32_t tag, tsize;
+        *r = g->results + i;
+        return 0;
+}
 
-                if (left < 8) {
-                        errno = EINVAL;
-                        return -1;
-                }
+static void disk_group_open_one(SkDiskGroupResult *r, unsigned flags) {
 
-                memcpy(&tag, p, 4);
-                memcpy(&tsize, p+1, 4);
-                p += 2;
-                left -= 8;
+        if (r->disk)
+                return;
 
-                if (left < ntohl(tsize)) {
-                        errno = EINVAL;
-                        return -1;
-                }
+        r->error = sk_disk_open(r->name, &r->disk) < 0 ? errno : 0;
+}
 
-                switch (tag) {
+static void disk_group_refresh_one(SkDiskGroupResult *r, unsigned flags) {
+        SkBool available;
 
-                        case SK_BLOB_TAG_IDENTIFY:
-                                if (ntohl(tsize) != sizeof(d->identify) || idv) {
-                                        errno = EINVAL;
-                                        return -1;
-                                }
-                                idv = TRUE;
-                                break;
+        r->overall_valid = FALSE;
 
-                        case SK_BLOB_TAG_SMART_STATUS:
-                                if (ntohl(tsize) != 4 || bssv) {
-                                        errno = EINVAL;
-                                        return -1;
-                                }
-                                bssv = TRUE;
-                                break;
+        if (!r->disk) {
+                /* Keep the error from opening it, if there was one */
+                if (r->error == 0)
+                        r->error = EBADF;
+                return;
+        }
 
-                        case SK_BLOB_TAG_SMART_DATA:
-                                if (ntohl(tsize) != sizeof(d->smart_data) || sdv) {
-                                        errno = EINVAL;
-                                        return -1;
-                                }
-                                sdv = TRUE;
-                                break;
+        if (sk_disk_smart_is_available(r->disk, &available) < 0 || !available)
+                flags &= SK_DISK_REFRESH_IDENTIFY;
 
-                        case SK_BLOB_TAG_SMART_THRESHOLDS:
-                                if (ntohl(tsize) != sizeof(d->smart_thresholds) || stv) {
-                                        errno = EINVAL;
-                                        return -1;
-                                }
-                                stv = TRUE;
-                                break;
+        if (sk_disk_refresh(r->disk, flags) < 0) {
+                r->error = errno;
+                return;
+        }
+
+        /* The overall health needs both the data and the status.
+         * Unless both were just read, sk_disk_smart_get_overall()
+         * would send commands the caller didn't ask for. */
+        if ((flags & (SK_DISK_REFRESH_SMART_DATA|SK_DISK_REFRESH_STATUS)) == (SK_DISK_REFRESH_SMART_DATA|SK_DISK_REFRESH_STATUS) &&
+            sk_disk_smart_is_available(r->disk, &available) >= 0 && available) {
+                if (sk_disk_smart_get_overall(r->disk, &r->overall) < 0) {
+                        r->error = errno;
+                        return;
                 }
 
-                p = (uint32_t*) ((uint8_t*) p + ntohl(tsize));
-                left -= ntohl(tsize);
+                r->overall_valid = TRUE;
         }
 
-        if (!idv) {
-                errno = -ENODATA;
-                return -1;
-        }
+        r->error = 0;
+}
 
-        d->identify_valid = idv;
-        d->smart_data_valid = sdv;
-        d->smart_thresholds_valid = stv;
-        d->blob_smart_status_valid = bssv;
+static void* disk_group_worker(void *userdata) {
+        SkDiskGroup *g = userdata;
+        unsigned i;
 
-        /* Second run, actually copy things in */
-        p = blob;
-        left = size;
-        while (left > 0) {
-                uint32_t tag, tsize;
+        /* Every disk is handled by exactly one worker, so a hung
+         * device only ever blocks the one that picked it */
+        while ((i = __sync_fetch_and_add(&g->next, 1)) < g->n_disks)
+                g->job(g->results + i, g->flags);
 
-                assert(left >= 8);
-                memcpy(&tag, p, 4);
-                memcpy(&tsize, p+1, 4);
-                p += 2;
-                left -= 8;
+        return NULL;
+}
 
-                assert(left >= ntohl(tsize));
+static void disk_group_run(SkDiskGroup *g, void (*job)(SkDiskGroupResult *r, unsigned flags), unsigned flags) {
+        pthread_t *threads = NULL;
+        unsigned n, i, started = 0;
 
-                switch (tag) {
+        g->job = job;
+        g->flags = flags;
+        g->next = 0;
 
-                        case SK_BLOB_TAG_IDENTIFY:
-                                assert(ntohl(tsize) == sizeof(d->identify));
-                                memcpy(d->identify, p, sizeof(d->identify));
-                                break;
+        /* The calling thread is a worker too */
+        n = MIN(g->max_workers, g->n_disks);
 
-                        case SK_BLOB_TAG_SMART_STATUS: {
-                                uint32_t ok;
-                                assert(ntohl(tsize) == 4);
-                                memcpy(&ok, p, 4);
-                                d->blob_smart_status = !!ok;
-                                break;
-                        }
+        if (n > 1) {
+                threads = alloca(sizeof(pthread_t) * (n - 1));
 
-                        case SK_BLOB_TAG_SMART_DATA:
-                                assert(ntohl(tsize) == sizeof(d->smart_data));
-                                memcpy(d->smart_data, p, sizeof(d->smart_data));
+                /* If we can't get all threads we make do with fewer */
+                for (; started < n - 1; started++)
+                        if (pthread_create(&threads[started], NULL, disk_group_worker, g) != 0)
                                 break;
+        }
 
-                        case SK_BLOB_TAG_SMART_THRESHOLDS:
-                                assert(ntohl(tsize) == sizeof(d->smart_thresholds));
-                                memcpy(d->smart_thresholds, p, sizeof(d->smart_thresholds));
-                                break;
-                }
+        disk_group_worker(g);
 
-                p = (uint32_t*) ((uint8_t*) p + ntohl(tsize));
-                left -= ntohl(tsize);
+        for (i = 0; i < started; i++)
+                pthread_join(threads[i], NULL);
+}
+
+int sk_disk_group_open(SkDiskGroup *g) {
+        assert(g);
+
+        disk_group_run(g, disk_group_open_one, 0);
+        return 0;
+}
+
+int sk_disk_group_refresh(SkDiskGroup *g, unsigned flags) {
+        assert(g);
+
+        if (flags & ~(SK_DISK_REFRESH_SMART_DATA|SK_DISK_REFRESH_STATUS|SK_DISK_REFRESH_IDENTIFY|SK_DISK_REFRESH_THRESHOLDS)) {
+                errno = EINVAL;
+                return -1;
         }
 
+        disk_group_run(g, disk_group_refresh_one, flags);
         return 0;
 }
@@ -145,6 +145,27 @@ typedef enum SkSmartAttributeUnit {
 
 const char* sk_smart_attribute_unit_to_string(SkSmartAttributeUnit unit);
 
+/* What an attribute is about, regardless of the vendor specific name
+ * and encoding it comes with */
+typedef enum SkSmartAttributeRole {
+        SK_SMART_ATTRIBUTE_ROLE_NONE,
+        SK_SMART_ATTRIBUTE_ROLE_TEMPERATURE,
+        SK_SMART_ATTRIBUTE_ROLE_POWER_ON_TIME,
+        SK_SMART_ATTRIBUTE_ROLE_POWER_CYCLES,
+        SK_SMART_ATTRIBUTE_ROLE_REALLOCATED_SECTORS,
+        SK_SMART_ATTRIBUTE_ROLE_PENDING_SECTORS,
+        SK_SMART_ATTRIBUTE_ROLE_UNCORRECTABLE_SECTORS,
+        SK_SMART_ATTRIBUTE_ROLE_WEAR,
+        SK_SMART_ATTRIBUTE_ROLE_RESERVED_SPACE,
+        _SK_SMART_ATTRIBUTE_ROLE_MAX
+
+        /* This enum may be extended at any time without this being
+         * considered an ABI change. So take care when you use this
+         * type! */
+} SkSmartAttributeRole;
+
+const char* sk_smart_attribute_role_to_string(SkSmartAttributeRole role);
+
 typedef struct SkSmartAttributeParsedData {
         /* Fixed data */
         uint8_t id;
@@ -168,10 +189,20 @@ typedef struct SkSmartAttributeParsedData {
         uint64_t pretty_value;
         uint8_t raw[6];
 
+        SkSmartAttributeRole role;
+
         /* This structure may be extended at any time without this being
          * considered an ABI change. So take care when you copy it. */
 } SkSmartAttributeParsedData;
 
+/* The maximum number of attributes a SMART data page can contain */
+#define SK_SMART_ATTRIBUTES_MAX 30
+
+/* A set of attribute IDs, one bit per ID */
+#define SK_SMART_ATTRIBUTE_MASK_SIZE (256/8)
+#define SK_SMART_ATTRIBUTE_MASK_SET(mask, id) ((mask)[(uint8_t) (id) >> 3] |= (uint8_t) (1U << ((uint8_t) (id) & 7)))
+#define SK_SMART_ATTRIBUTE_MASK_TEST(mask, id) (!!((mask)[(uint8_t) (id) >> 3] & (1U << ((uint8_t) (id) & 7))))
+
 typedef struct SkDisk SkDisk;
 
 typedef enum SkSmartOverall  {
@@ -192,6 +223,10 @@ const char* sk_smart_overall_to_string(SkSmartOverall overall);
 
 int sk_disk_open(const char *name, SkDisk **d);
 
+/* Like sk_disk_open(), but gives up with ETIMEDOUT if the disk can't
+ * be identified within usec, see sk_disk_set_deadline() */
+int sk_disk_open_with_timeout(const char *name, uint64_t usec, SkDisk **d);
+
 int sk_disk_get_size(SkDisk *d, uint64_t *bytes);
 
 int sk_disk_check_sleep_mode(SkDisk *d, SkBool *awake);
@@ -202,7 +237,14 @@ int sk_disk_identify_parse(SkDisk *d, const SkIdentifyParsedData **data);
 typedef void (*SkSmartAttributeParseCallback)(SkDisk *d, const SkSmartAttributeParsedData *a, void* userdata);
 
 int sk_disk_smart_is_available(SkDisk *d, SkBool *available);
+
+/* Always asks the disk for its SMART status (subject to the refresh
+ * policy, see below). sk_disk_smart_get_overall() and
+ * sk_disk_get_blob() reuse the last status instead, if it was read
+ * after the current SMART data or less than the TTL set with
+ * sk_disk_set_status_ttl() ago. The TTL is 0, i.e. off, by default. */
 int sk_disk_smart_status(SkDisk *d, SkBool *good);
+int sk_disk_set_status_ttl(SkDisk *d, uint64_t usec);
 
 /* Reading SMART data might cause the disk to wake up from
  * sleep. Hence from monitoring daemons make sure to call
@@ -210,13 +252,163 @@ int sk_disk_smart_status(SkDisk *d, SkBool *good);
  * skip the read if so. */
 int sk_disk_smart_read_data(SkDisk *d);
 
+/* Same as sk_disk_smart_read_data(), but tells whether the page
+ * differs from the one read before. If it doesn't, everything parsed
+ * from it so far stays valid. Pages with a bad checksum are refused
+ * with EIO. */
+int sk_disk_smart_read_data_changed(SkDisk *d, SkBool *changed);
+
+/* Same as sk_disk_smart_read_data_changed(), but the page is read
+ * straight into buf, which needs room for SK_DISK_PAGE_SIZE bytes. For
+ * SG_IO the kernel can map the buffer directly if it is suitably
+ * aligned, page alignment is a safe choice. If the device isn't asked
+ * because of the refresh policy, the page read before is copied into
+ * buf instead. changed may be NULL. */
+int sk_disk_smart_read_data_into(SkDisk *d, void *buf, size_t size, SkBool *changed);
+
+/* Reads the SMART data of n disks at once. Disks attached via SAT get
+ * their command queued on their sg node, so all of them are in flight
+ * at the same time and this takes about as long as the slowest
+ * one. Disks where that isn't possible are read one after the
+ * other while the queued commands are in flight. Stores 0 or the errno for each disk in errors, a disk listed
+ * twice gets EBUSY. Any other command for a disk waits until its queued
+ * command has come back. */
+int sk_disk_smart_read_data_parallel(SkDisk **disks, unsigned n, int *errors);
+
+/* Split-phase version of sk_disk_smart_read_data_changed() for event
+ * loops. sk_disk_smart_read_data_begin() queues the command where
+ * possible and executes it right away otherwise. Then wait until the
+ * fd returned by sk_disk_get_poll_fd() is readable (POLLIN) and call
+ * sk_disk_smart_read_data_finish(), which fails with EAGAIN if the
+ * answer isn't there yet. If the fd is -1 the result is ready
+ * already. sk_disk_get_timeout_hint() returns how much longer the
+ * command may take before the kernel gives up on it, call _finish()
+ * when that passes even if the fd didn't wake up. Only one command may
+ * be pending per disk, _begin() fails with EBUSY otherwise. */
+int sk_disk_smart_read_data_begin(SkDisk *d);
+int sk_disk_smart_read_data_finish(SkDisk *d, SkBool *changed);
+int sk_disk_get_poll_fd(SkDisk *d, int *fd);
+int sk_disk_get_timeout_hint(SkDisk *d, uint64_t *usec);
+
+typedef enum SkDiskRefreshFlags {
+        SK_DISK_REFRESH_SMART_DATA = 1,
+        SK_DISK_REFRESH_STATUS = 2,
+        SK_DISK_REFRESH_IDENTIFY = 4,
+        SK_DISK_REFRESH_THRESHOLDS = 8
+} SkDiskRefreshFlags;
+
+/* Re-reads the selected parts of a long-lived handle. The transport,
+ * the size and everything not selected are kept. Whatever is derived
+ * from a page is only recomputed if the page actually changed. Stops
+ * at the first failure. */
+int sk_disk_refresh(SkDisk *d, unsigned flags);
+
+/* Limits how often SMART READ DATA and SMART RETURN STATUS are sent to
+ * the device: at most once every min_interval_usec for each of them,
+ * and at most max_commands_per_hour of both together. 0 disables the
+ * respective limit, which is the default. While a limit is in effect
+ * sk_disk_smart_read_data() and sk_disk_smart_status() return the
+ * answer read before, or fail with EAGAIN if there is none. Commands
+ * that never reach the device do not count against the hourly limit. */
+int sk_disk_set_refresh_policy(SkDisk *d, uint64_t min_interval_usec, unsigned max_commands_per_hour);
+
+typedef enum SkCommandClass {
+        SK_COMMAND_CLASS_IDENTIFY,
+        SK_COMMAND_CLASS_STATUS,     /* SMART status and power mode */
+        SK_COMMAND_CLASS_READ_DATA,  /* SMART data and thresholds */
+        SK_COMMAND_CLASS_SELF_TEST,
+        SK_COMMAND_CLASS_CONTROL,    /* enabling and disabling SMART */
+        _SK_COMMAND_CLASS_MAX
+} SkCommandClass;
+
+/* Sets how long the kernel waits for commands of class c before
+ * aborting them, in msec. Commands that time out fail with
+ * ETIMEDOUT. 0 restores the default of 2s. The legacy IDE ioctls
+ * can't be given a timeout. */
+int sk_disk_set_timeout(SkDisk *d, SkCommandClass c, unsigned msec);
+
+/* Sets a deadline usec from now for everything that follows: command
+ * timeouts are shortened to the time left, and once it has passed
+ * commands fail with ETIMEDOUT without being sent. 0 removes it. */
+int sk_disk_set_deadline(SkDisk *d, uint64_t usec);
+
+/* Stops sending commands to a disk that keeps failing. After failures
+ * consecutive timeouts or I/O errors every command fails right away
+ * with ECANCELED for base_msec. Then a single command is let through
+ * as a probe. If that fails too the wait doubles, up to max_msec, any
+ * success closes the breaker again. failures = 0 disables this, which
+ * is the default. */
+int sk_disk_set_circuit_breaker(SkDisk *d, unsigned failures, unsigned base_msec, unsigned max_msec);
+
+/* How long ago the SMART data and status were read from the
+ * device. Fails with ENODATA if they never were, e.g. for blobs. */
+int sk_disk_smart_get_data_age(SkDisk *d, uint64_t *usec);
+int sk_disk_smart_get_status_age(SkDisk *d, uint64_t *usec);
+
 int sk_disk_get_blob(SkDisk *d, const void **blob, size_t *size);
+
+#define SK_DISK_PAGE_SIZE 512
+
+typedef enum SkDiskPage {
+        SK_DISK_PAGE_IDENTIFY,
+        SK_DISK_PAGE_SMART_DATA,
+        SK_DISK_PAGE_SMART_THRESHOLDS,
+        _SK_DISK_PAGE_MAX
+} SkDiskPage;
+
+/* Returns a pointer to our copy of the raw page, which is
+ * SK_DISK_PAGE_SIZE bytes long, together with whether it has been read
+ * and the generation of the disk data. The pointer stays valid until
+ * sk_disk_free(), but the contents are overwritten when the page is
+ * read again. In thread safe mode use sk_disk_get_snapshot()
+ * instead. valid and generation may be NULL. */
+int sk_disk_get_page(SkDisk *d, SkDiskPage page, const void **data, SkBool *valid, unsigned *generation);
 int sk_disk_set_blob(SkDisk *d, const void *blob, size_t size);
 
 int sk_disk_smart_parse(SkDisk *d, const SkSmartParsedData **data);
 int sk_disk_smart_parse_attributes(SkDisk *d, SkSmartAttributeParseCallback cb, void* userdata);
+
+/* Like sk_disk_smart_parse_attributes(), but only decodes the
+ * attributes whose ID is set in mask, each at most once. Returns
+ * early when all of them have been found. */
+int sk_disk_smart_parse_attributes_masked(SkDisk *d, const uint8_t mask[SK_SMART_ATTRIBUTE_MASK_SIZE], SkSmartAttributeParseCallback cb, void* userdata);
+
+/* Parses all attributes in one go and stores them in the array a,
+ * which has room for n_max entries. The number of attributes stored
+ * is returned in n. Fails with ENOBUFS if the array is too small,
+ * pass SK_SMART_ATTRIBUTES_MAX entries to avoid that. */
+int sk_disk_smart_get_attributes(SkDisk *d, SkSmartAttributeParsedData *a, size_t n_max, size_t *n);
+
+/* Parses only the attribute with the specified ID. Fails with ENOENT
+ * if the disk doesn't report it. */
+int sk_disk_smart_get_attribute(SkDisk *d, uint8_t id, SkSmartAttributeParsedData *a);
 int sk_disk_smart_self_test(SkDisk *d, SkSmartSelfTest test);
 
+/* Aggregated values of the most commonly used attributes */
+typedef struct SkSmartSummary {
+        SkBool temperature_valid:1;
+        SkBool power_on_valid:1;
+        SkBool power_cycle_valid:1;
+        SkBool reallocated_sector_count_valid:1;
+        SkBool current_pending_sector_valid:1;
+
+        SkBool bad_attribute_now:1;         /* At least one pre-fail attribute is exceeding its threshold now */
+        SkBool bad_attribute_in_the_past:1; /* At least one pre-fail attribute exceeded its threshold in the past */
+
+        uint64_t temperature_mkelvin;
+        uint64_t power_on_mseconds;
+        uint64_t power_cycle_count;
+        uint64_t reallocated_sector_count;
+        uint64_t current_pending_sector;
+
+        /* This structure may be extended at any time without this being
+         * considered an ABI change. So take care when you copy it. */
+} SkSmartSummary;
+
+/* High level API to get the most commonly used attributes, decoded
+ * in a single pass. The getters below are based on this. */
+int sk_disk_smart_get_summary(SkDisk *d, const SkSmartSummary **summary);
+
 /* High level API to get the power on time */
 int sk_disk_smart_get_power_on(SkDisk *d, uint64_t *mseconds);
 
@@ -237,6 +429,128 @@ int sk_disk_dump(SkDisk *d);
 
 void sk_disk_free(SkDisk *d);
 
+/* A snapshot is an immutable copy of the data read from a disk. It
+ * is reference counted and may be used from any number of threads at
+ * the same time without locking, while the disk it was taken from is
+ * busy reading new data. All parsing is done when the snapshot is
+ * created, hence the functions below never issue any commands. */
+typedef struct SkSnapshot SkSnapshot;
+
+typedef void (*SkSnapshotAttributeParseCallback)(SkSnapshot *s, const SkSmartAttributeParsedData *a, void* userdata);
+
+/* Takes a snapshot of what has been read from the disk so far. Like
+ * sk_disk_get_blob() this includes the SMART status. */
+int sk_disk_snapshot(SkDisk *d, SkSnapshot **snapshot);
+int sk_snapshot_new_from_blob(const void *blob, size_t size, SkSnapshot **snapshot);
+
+typedef enum SkDiskAcquireFlags {
+        SK_DISK_ACQUIRE_NO_WAKEUP = 1, /* Fail with EAGAIN instead of waking up a sleeping disk */
+        SK_DISK_ACQUIRE_NO_STATUS = 2  /* Don't ask for the SMART status, and leave it out of the snapshot */
+} SkDiskAcquireFlags;
+
+/* How long each command took while acquiring a snapshot, 0 if it
+ * wasn't sent */
+typedef struct SkSnapshotTimings {
+        uint64_t check_power_mode_usec;
+        uint64_t smart_read_thresholds_usec; /* includes enabling SMART on first use */
+        uint64_t smart_status_usec;
+        uint64_t smart_read_data_usec;
+        uint64_t total_usec;
+
+        /* This structure may be extended at any time without this being
+         * considered an ABI change. So take care when you copy it. */
+} SkSnapshotTimings;
+
+/* Reads everything needed for a complete snapshot with as few
+ * commands as possible: the power mode (only with
+ * SK_DISK_ACQUIRE_NO_WAKEUP), the SMART status, the SMART data and the
+ * thresholds, the latter only if we don't have them yet. */
+int sk_disk_acquire(SkDisk *d, unsigned flags, SkSnapshot **snapshot);
+
+SkSnapshot* sk_snapshot_ref(SkSnapshot *s);
+void sk_snapshot_unref(SkSnapshot *s);
+
+int sk_snapshot_get_blob(SkSnapshot *s, const void **blob, size_t *size);
+int sk_snapshot_get_size(SkSnapshot *s, uint64_t *bytes);
+int sk_snapshot_get_timings(SkSnapshot *s, const SkSnapshotTimings **timings);
+
+int sk_snapshot_identify_is_available(SkSnapshot *s, SkBool *available);
+int sk_snapshot_identify_parse(SkSnapshot *s, const SkIdentifyParsedData **data);
+
+int sk_snapshot_smart_is_available(SkSnapshot *s, SkBool *available);
+int sk_snapshot_smart_status(SkSnapshot *s, SkBool *good);
+int sk_snapshot_smart_parse(SkSnapshot *s, const SkSmartParsedData **data);
+int sk_snapshot_smart_parse_attributes(SkSnapshot *s, SkSnapshotAttributeParseCallback cb, void* userdata);
+int sk_snapshot_smart_parse_attributes_masked(SkSnapshot *s, const uint8_t mask[SK_SMART_ATTRIBUTE_MASK_SIZE], SkSnapshotAttributeParseCallback cb, void* userdata);
+int sk_snapshot_smart_get_attributes(SkSnapshot *s, SkSmartAttributeParsedData *a, size_t n_max, size_t *n);
+int sk_snapshot_smart_get_attribute(SkSnapshot *s, uint8_t id, SkSmartAttributeParsedData *a);
+int sk_snapshot_smart_get_summary(SkSnapshot *s, const SkSmartSummary **summary);
+int sk_snapshot_smart_get_power_on(SkSnapshot *s, uint64_t *mseconds);
+int sk_snapshot_smart_get_power_cycle(SkSnapshot *s, uint64_t *count);
+int sk_snapshot_smart_get_bad(SkSnapshot *s, uint64_t *sectors);
+int sk_snapshot_smart_get_temperature(SkSnapshot *s, uint64_t *mkelvin);
+int sk_snapshot_smart_get_overall(SkSnapshot *s, SkSmartOverall *overall);
+
+/* Threading: by default an SkDisk may only be used by one thread at
+ * a time, but different disks may be used from different threads
+ * without any locking, since there is no global state shared between
+ * them.
+ *
+ * After sk_disk_set_thread_safe(d, TRUE) all sk_disk_* calls on d may
+ * be made from any thread. They are serialized on a lock owned by d,
+ * so only one command is ever sent to the device at a time. Pointers
+ * returned by sk_disk_identify_parse(), sk_disk_smart_parse(),
+ * sk_disk_smart_get_summary() and sk_disk_get_blob() remain owned by
+ * d however, and may change as soon as another thread reads new data.
+ * Threads that just want to look at the data should use
+ * sk_disk_get_snapshot() instead: whenever new data has been read a
+ * new snapshot is published, and getting it never waits for a
+ * command in progress. Threads calling sk_disk_smart_read_data() or
+ * sk_disk_smart_status() while the same command is already in flight
+ * wait for it and share its result instead of sending it again. Call
+ * sk_disk_set_thread_safe(d, TRUE) before sharing the disk between
+ * threads. Turning it off again is safe at any time, d keeps
+ * serializing calls on its lock but stops publishing snapshots. */
+int sk_disk_set_thread_safe(SkDisk *d, SkBool b);
+
+/* Returns a reference to the most recently published snapshot, which
+ * needs to be released with sk_snapshot_unref(). Fails with ENOTSUP
+ * if d is not in thread safe mode. Published snapshots contain the
+ * last SMART status read, if any. */
+int sk_disk_get_snapshot(SkDisk *d, SkSnapshot **snapshot);
+
+/* A group of disks that are opened and refreshed concurrently by up
+ * to max_workers threads, each disk by one of them only. A disk that
+ * hangs therefore only holds up its own worker, and a call on the
+ * whole group takes about as long as the slowest disk. The group
+ * itself must only be used from one thread at a time. */
+typedef struct SkDiskGroup SkDiskGroup;
+
+typedef struct SkDiskGroupResult {
+        const char *name;
+        SkDisk *disk;          /* NULL until opened successfully, owned by the group */
+        int error;             /* errno of the last operation, 0 on success */
+        SkBool overall_valid;  /* FALSE if the disk can't do SMART or the SMART data and status weren't both refreshed */
+        SkSmartOverall overall;
+} SkDiskGroupResult;
+
+int sk_disk_group_new(unsigned max_workers, SkDiskGroup **g);
+void sk_disk_group_free(SkDiskGroup *g);
+
+/* idx may be NULL. Adding disks invalidates the pointers returned by
+ * sk_disk_group_get(). */
+int sk_disk_group_add(SkDiskGroup *g, const char *name, unsigned *idx);
+
+/* Open all disks not opened yet and refresh all disks with
+ * sk_disk_refresh(). If both the SMART data and the status were
+ * refreshed their overall health is evaluated afterwards. These only
+ * fail on bad arguments, the outcome for each disk is stored in its
+ * result. */
+int sk_disk_group_open(SkDiskGroup *g);
+int sk_disk_group_refresh(SkDiskGroup *g, unsigned flags);
+
+int sk_disk_group_get(SkDiskGroup *g, unsigned i, const SkDiskGroupResult **r);
+
 #ifdef __cplusplus
 }
 #endif